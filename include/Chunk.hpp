@@ -40,35 +40,59 @@ namespace rtcdcpp {
 class Chunk {
  private:
   size_t len{0};
+  size_t capacity{0};
   uint8_t *data{nullptr};
+  // Frees an adopted buffer, data is ours to delete[] when null
+  void (*release)(void *){nullptr};
+
+  void FreeData() {
+    if (release) {
+      release(data);
+      release = nullptr;
+    } else {
+      delete[] data;
+    }
+    data = nullptr;
+  }
 
  public:
-  // TODO memory pool?
   // XXX should we just use a vector?
 
   // Makes a copy of data
-  Chunk(const void *dataToCopy, size_t dataLen) : len(dataLen), data(new uint8_t[len]) { memcpy(data, dataToCopy, dataLen); }
+  Chunk(const void *dataToCopy, size_t dataLen) : len(dataLen), capacity(dataLen), data(new uint8_t[len]) { memcpy(data, dataToCopy, dataLen); }
+
+  // Uninitialized buffer of the given capacity, with Size() == capacity until Resize() is called
+  explicit Chunk(size_t dataCapacity) : len(dataCapacity), capacity(dataCapacity), data(new uint8_t[dataCapacity]) {}
+
+  // Adopts a buffer allocated elsewhere without copying it, releaseData(dataToAdopt) is called on destruction
+  Chunk(void *dataToAdopt, size_t dataLen, void (*releaseData)(void *))
+      : len(dataLen), capacity(dataLen), data(static_cast<uint8_t *>(dataToAdopt)), release(releaseData) {}
 
   // Copy constructor
-  Chunk(const Chunk &other) : len(other.len), data(new uint8_t[len]) { memcpy(data, other.data, other.len); }
+  Chunk(const Chunk &other) : len(other.len), capacity(other.len), data(new uint8_t[len]) { memcpy(data, other.data, other.len); }
 
   // Assignment operator
   Chunk &operator=(const Chunk &other) {
     if (data) {
       len = 0;
-      delete[] data;
+      FreeData();
     }
     len = other.len;
+    capacity = other.len;
     data = new uint8_t[len];
     memcpy(data, other.data, other.len);
     return *this;
   }
 
-  ~Chunk() { delete[] data; }
+  ~Chunk() { FreeData(); }
 
   size_t Size() const { return len; }
   size_t Length() const { return Size(); }
+  size_t Capacity() const { return capacity; }
   uint8_t *Data() const { return data; }
+
+  // Shrink or grow the valid region within the existing buffer
+  void Resize(size_t newLen) { len = newLen <= capacity ? newLen : capacity; }
 };
 
 using ChunkPtr = std::shared_ptr<Chunk>;
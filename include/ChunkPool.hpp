@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Simple thread-safe pool of fixed capacity chunks.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include "Chunk.hpp"
+
+namespace rtcdcpp {
+
+/**
+ * Hands out ChunkPtrs whose buffers go back to the pool when the last reference is dropped.
+ * Chunks may outlive the pool, they are then simply freed.
+ */
+class ChunkPool {
+ private:
+  struct FreeList {
+    std::mutex mut;
+    std::vector<Chunk *> chunks;
+    size_t max_free;
+
+    explicit FreeList(size_t max_free) : max_free(max_free) {}
+    ~FreeList() {
+      for (Chunk *chunk : chunks) {
+        delete chunk;
+      }
+    }
+  };
+
+  const size_t chunk_capacity;
+  std::shared_ptr<FreeList> free_list;
+
+ public:
+  ChunkPool(size_t chunk_capacity, size_t max_free) : chunk_capacity(chunk_capacity), free_list(std::make_shared<FreeList>(max_free)) {}
+
+  // Chunk of Size() len. Requests larger than the pool's capacity get a plain, unpooled chunk.
+  ChunkPtr Get(size_t len) {
+    if (len > chunk_capacity) {
+      return std::make_shared<Chunk>(len);
+    }
+
+    Chunk *chunk = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(free_list->mut);
+      if (!free_list->chunks.empty()) {
+        chunk = free_list->chunks.back();
+        free_list->chunks.pop_back();
+      }
+    }
+    if (!chunk) {
+      chunk = new Chunk(chunk_capacity);
+    }
+    chunk->Resize(len);
+
+    std::weak_ptr<FreeList> weak_free_list = free_list;
+    return ChunkPtr(chunk, [weak_free_list](Chunk *released) {
+      auto list = weak_free_list.lock();
+      if (list) {
+        std::lock_guard<std::mutex> lock(list->mut);
+        if (list->chunks.size() < list->max_free) {
+          list->chunks.push_back(released);
+          return;
+        }
+      }
+      delete released;
+    });
+  }
+
+  // Pooled copy of data
+  ChunkPtr Get(const void *data, size_t len) {
+    ChunkPtr chunk = Get(len);
+    memcpy(chunk->Data(), data, len);
+    return chunk;
+  }
+};
+}
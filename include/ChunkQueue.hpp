@@ -31,8 +31,10 @@
 
 #pragma once
 
+#include <chrono>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 #include "Chunk.hpp"
 
@@ -72,6 +74,29 @@ class EXPORT ChunkQueue {
     data_cond.notify_one();
   }
 
+  void push_all(const std::vector<ChunkPtr> &chunks) {
+    std::lock_guard<std::mutex> lock(mut);
+    if (stopping || chunks.empty()) {
+      return;
+    }
+    for (auto &chunk : chunks) {
+      chunk_queue.push(chunk);
+    }
+    data_cond.notify_one();
+  }
+
+  // Appends everything queued right now to chunks, without waiting
+  void pop_all(std::vector<ChunkPtr> &chunks) {
+    std::lock_guard<std::mutex> lock(mut);
+    if (stopping) {
+      return;
+    }
+    while (!chunk_queue.empty()) {
+      chunks.push_back(chunk_queue.front());
+      chunk_queue.pop();
+    }
+  }
+
   ChunkPtr wait_and_pop() {
     std::unique_lock<std::mutex> lock(mut);
     while (!stopping && chunk_queue.empty()) {
@@ -87,6 +112,26 @@ class EXPORT ChunkQueue {
     return res;
   }
 
+  // Like wait_and_pop, but also returns an empty ChunkPtr once timeout has passed
+  template <class Rep, class Period>
+  ChunkPtr wait_and_pop_for(const std::chrono::duration<Rep, Period> &timeout) {
+    std::unique_lock<std::mutex> lock(mut);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!stopping && chunk_queue.empty()) {
+      if (data_cond.wait_until(lock, deadline) == std::cv_status::timeout) {
+        break;
+      }
+    }
+
+    if (stopping || chunk_queue.empty()) {
+      return ChunkPtr();
+    }
+
+    ChunkPtr res = chunk_queue.front();
+    chunk_queue.pop();
+    return res;
+  }
+
   bool empty() const {
     std::lock_guard<std::mutex> lock(mut);
     return chunk_queue.empty();
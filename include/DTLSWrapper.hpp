@@ -30,10 +30,12 @@
 /**
  * Wrapper around OpenSSL DTLS.
  */
+#include <deque>
 #include <thread>
 
 #include "openssl/ssl.h"
 
+#include "ChunkPool.hpp"
 #include "ChunkQueue.hpp"
 #include "PeerConnection.hpp"
 #include "RTCCertificate.hpp"
@@ -41,6 +43,9 @@
 
 namespace rtcdcpp {
 
+// Header, explicit IV, MAC and padding of a DTLS 1.2 record in the worst case
+#define DTLS_MAX_RECORD_OVERHEAD 100
+
 class DTLSWrapper {
  public:
   DTLSWrapper(PeerConnection *peer_connection);
@@ -54,9 +59,20 @@ class DTLSWrapper {
 
   void EncryptData(ChunkPtr chunk);
   void DecryptData(ChunkPtr chunk);
+  // Queue several received datagrams at once
+  void DecryptBatch(const std::vector<ChunkPtr> &chunks);
 
   void SetEncryptedCallback(std::function<void(ChunkPtr chunk)>);
-  void SetDecryptedCallback(std::function<void(ChunkPtr chunk)>);
+  // Receives all records decrypted from one batch of datagrams, in order
+  void SetDecryptedCallback(std::function<void(const std::vector<ChunkPtr> &records)>);
+
+  // Cheap to call at any time, does not take the SSL lock
+  RTCDtlsStats GetStats() const;
+
+  // Largest datagram OpenSSL may emit, e.g. while fragmenting handshake flights
+  void SetLinkMtu(uint16_t mtu);
+  // Bytes each record adds to its plaintext with the negotiated cipher, valid once the handshake is done
+  uint16_t GetRecordOverhead();
 
  private:
   PeerConnection *peer_connection;
@@ -77,11 +93,59 @@ class DTLSWrapper {
   std::mutex ssl_mutex;
   SSL_CTX *ctx;
   SSL *ssl;
-  BIO *in_bio, *out_bio;
-
-  bool handshake_complete;
-
-  std::function<void(ChunkPtr chunk)> decrypted_callback;
+  BIO *bio;
+  uint16_t link_mtu;
+
+  // Datagram BIO: reads hand OpenSSL the current inbound chunk, every write becomes one outbound chunk
+  ChunkPtr in_datagram;
+  ChunkPool out_pool;
+  ChunkPool in_pool;
+
+  // Feeds datagram to OpenSSL and appends every record it yields to records, ssl_mutex must be held.
+  // Returns the SSL_get_error code of the final SSL_read.
+  int ReadRecords(ChunkPtr datagram, std::vector<ChunkPtr> &records);
+
+  int OnBIORead(char *buf, int len);
+  int OnBIOWrite(const char *buf, int len);
+  static BIO_METHOD *DatagramBIOMethod();
+  static int _OnBIORead(BIO *bio, char *buf, int len);
+  static int _OnBIOWrite(BIO *bio, const char *buf, int len);
+  static long _OnBIOCtrl(BIO *bio, int cmd, long num, void *ptr);
+  static int _OnBIOCreate(BIO *bio);
+
+  std::atomic<bool> handshake_complete;
+  std::atomic<bool> handshake_failed{false};
+
+  // Until the handshake completes, inbound datagrams are queued here and processed on the HandshakePool
+  std::mutex handshake_mutex;
+  std::deque<ChunkPtr> handshake_inbox;
+  bool handshake_admitted{false};
+  bool handshake_drain_scheduled{false};
+  // Set once the handshake finished or failed, the outcome is reported from the decrypt thread
+  std::atomic<bool> handshake_result_pending{false};
+  std::vector<ChunkPtr> handshake_records;
+  // Queued by the HandshakePool to wake the decrypt thread when the outcome is ready
+  ChunkPtr handshake_wakeup;
+
+  void BeginHandshake();
+  void RunHandshake();
+  // Runs on the decrypt thread, hands over records read during the handshake and reports the outcome
+  void FinishHandshake();
+
+  // Static OpenSSL strings, published once the handshake completes
+  std::atomic<const char *> cipher_suite{nullptr};
+  std::atomic<const char *> protocol_version{nullptr};
+
+  std::chrono::steady_clock::time_point handshake_start;
+  std::atomic<int64_t> handshake_duration_ms{0};
+  std::atomic<uint32_t> handshake_retransmits{0};
+
+  // Time until the pending handshake flight must be resent, false if no flight is pending. ssl_mutex must be held.
+  bool GetRetransmitTimeout(std::chrono::microseconds &timeout);
+  void HandleRetransmitTimeout();
+  static unsigned int _OnDTLSTimer(SSL *ssl, unsigned int previous_us);
+
+  std::function<void(const std::vector<ChunkPtr> &records)> decrypted_callback;
   std::function<void(ChunkPtr chunk)> encrypted_callback;
 };
 }
@@ -65,6 +65,12 @@ namespace rtcdcpp {
 #define DATA_CHANNEL_PARTIAL_RELIABLE_TIMED 0x02
 #define DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED 0x82
 
+// Channel priorities, higher is more important (RFC 8831 section 6.4)
+#define DATA_CHANNEL_PRIORITY_BELOW_NORMAL 128
+#define DATA_CHANNEL_PRIORITY_NORMAL 256
+#define DATA_CHANNEL_PRIORITY_HIGH 512
+#define DATA_CHANNEL_PRIORITY_EXTRA_HIGH 1024
+
 typedef struct __attribute__((packed, aligned(1))) {
   uint8_t msg_type;
   uint8_t chan_type;
@@ -90,23 +96,29 @@ class EXPORT DataChannel {
   std::string label;
   std::string protocol;
   uint32_t reliability;
-  // TODO: Priority field
+  uint16_t priority;
+  // Bytes of the binary message currently being sent with SendBinaryFragment
+  size_t fragment_bytes_sent{0};
+  bool bundled{true};
 
   std::function<void()> open_cb;
   std::function<void(std::string)> str_msg_cb;
   // std::function<void(std::shared_ptr<uint8_t> data, int len)> bin_msg_cb;
   std::function<void(ChunkPtr)> bin_msg_cb;
+  std::function<void(ChunkPtr, bool)> fragment_cb;
   std::function<void()> closed_cb;
   std::function<void(std::string description)> error_cb;
 
   void OnOpen();
   void OnStringMsg(std::string msg);
   void OnBinaryMsg(ChunkPtr msg);
+  void OnFragment(ChunkPtr fragment, bool is_last);
   void OnClosed();
   void OnError(std::string description);
 
  public:
-  DataChannel(PeerConnection *pc, uint16_t stream_id, uint8_t chan_type, std::string label, std::string protocol, uint32_t reliability);
+  DataChannel(PeerConnection *pc, uint16_t stream_id, uint8_t chan_type, std::string label, std::string protocol, uint32_t reliability,
+              uint16_t priority = DATA_CHANNEL_PRIORITY_NORMAL);
   virtual ~DataChannel();
 
   /**
@@ -120,6 +132,11 @@ class EXPORT DataChannel {
    */
   uint8_t GetChannelType();
 
+  /**
+   * Get the priority, only enforced when the association uses SctpStreamScheduler::Priority.
+   */
+  uint16_t GetPriority();
+
   /**
    * Get the label for the DataChannel.
    * XXX: Labels are *not* unique.
@@ -142,8 +159,23 @@ class EXPORT DataChannel {
    */
   bool SendString(std::string msg);
   bool SendBinary(const uint8_t *msg, int len);
+
+  /**
+   * Send one binary message in pieces, without holding it in memory whole.
+   * is_last completes the message, the last piece must not be empty.
+   * No other message may be sent on this channel until the last piece has been sent.
+   * Without I-DATA on the association, sends on other channels wait for the message to complete.
+   */
+  bool SendBinaryFragment(const uint8_t *msg, int len, bool is_last);
   void StopSendData();
 
+  /**
+   * Whether sends may wait to share packets with other messages, when the
+   * PeerConnection has RTCSctpConfiguration::bundling. Defaults to true.
+   * Messages on unbundled channels go out at once, taking any held data along.
+   */
+  void SetBundled(bool bundled);
+
   // Callbacks
 
   /**
@@ -164,6 +196,14 @@ class EXPORT DataChannel {
    */
   void SetOnBinaryMsgCallback(std::function<void(ChunkPtr)> msg_binary_cb);
 
+  /**
+   * Called with each piece of a received string or binary message as it arrives,
+   * is_last marks the final piece. Small messages arrive as a single piece.
+   * Once set, replaces the string and binary callbacks, so large messages are
+   * never held in memory whole. See RTCSctpConfiguration::partial_delivery_point.
+   */
+  void SetOnFragmentCallback(std::function<void(ChunkPtr fragment, bool is_last)> fragment_cb);
+
   /**
    * Called when the DataChannel has been cleanly closed.
    * NOT called after the Close() method has been called
@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+/**
+ * Asynchronous, cached hostname resolution for ICE servers.
+ */
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __MINGW32__
+#define EXPORT __attribute__((dllexport))
+#else
+#define EXPORT
+#endif //__MINGW32__
+
+namespace rtcdcpp {
+
+/**
+ * Process-wide resolver that runs getaddrinfo on its own thread, so connection setup never
+ * blocks on DNS. Concurrent lookups of one hostname share a single query.
+ *
+ * Results are cached for a fixed time since getaddrinfo does not report record TTLs.
+ * Failed lookups are cached for a shorter time.
+ *
+ * Callbacks are tagged with an owner pointer so they can be cancelled when the owner goes away.
+ */
+class EXPORT DnsResolver {
+ public:
+  static DnsResolver &Instance();
+
+  // Defaults are 5 minutes for addresses and 30 seconds for failures
+  void Configure(std::chrono::seconds ttl, std::chrono::seconds negative_ttl);
+
+  /**
+   * Call on_resolved with the numeric IPv4 and IPv6 addresses of hostname, in the order
+   * getaddrinfo prefers them, or none if the lookup failed.
+   * Numeric and cached hostnames are answered right away on the calling thread,
+   * others on the resolver thread.
+   */
+  void Resolve(const std::string &hostname, const void *owner, std::function<void(const std::vector<std::string> &addresses)> on_resolved);
+
+  // Drop the owner's pending callbacks and wait for a running one.
+  // Must not be called from one of the owner's own callbacks.
+  void Cancel(const void *owner);
+
+  ~DnsResolver();
+
+ private:
+  DnsResolver();
+
+  struct Waiter {
+    const void *owner;
+    std::function<void(const std::vector<std::string> &addresses)> fn;
+  };
+
+  struct Entry {
+    std::vector<std::string> addresses;
+    std::chrono::steady_clock::time_point expires;
+    bool resolving{false};
+    std::vector<Waiter> waiters;
+  };
+
+  std::mutex mut;
+  std::condition_variable work_cond;
+  std::condition_variable idle_cond;
+
+  std::map<std::string, Entry> cache;
+  std::deque<std::string> lookups;
+  std::multiset<const void *> running;
+
+  std::chrono::seconds ttl;
+  std::chrono::seconds negative_ttl;
+
+  // Started with the first lookup
+  std::thread worker;
+  bool stopping{false};
+
+  void RunWorker();
+  static std::vector<std::string> Lookup(const std::string &hostname);
+};
+}
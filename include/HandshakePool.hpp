@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+/**
+ * Bounded worker pool for DTLS handshakes.
+ */
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#ifdef __MINGW32__
+#define EXPORT __attribute__((dllexport))
+#else
+#define EXPORT
+#endif //__MINGW32__
+
+namespace rtcdcpp {
+
+/**
+ * Process-wide pool that runs handshake work off the per-connection data path threads.
+ *
+ * At most max_active handshakes are admitted at once, later ones wait in FIFO order
+ * until an admitted handshake finishes or fails, so a reconnect storm queues new
+ * handshakes instead of starving established connections of CPU.
+ *
+ * Work is tagged with an owner pointer so it can be cancelled when the owner goes away.
+ */
+class EXPORT HandshakePool {
+ public:
+  static HandshakePool &Instance();
+
+  /**
+   * Change the pool limits. Workers are only ever added, never removed.
+   * Defaults are a quarter of the hardware threads (at least one) and 64 active handshakes.
+   */
+  void Configure(size_t workers, size_t max_active);
+
+  // Run on_admitted on a worker once the owner's handshake fits under max_active
+  void Admit(const void *owner, std::function<void()> on_admitted);
+
+  // Run task on a worker. The caller is responsible for not posting concurrent tasks for one owner.
+  void Post(const void *owner, std::function<void()> task);
+
+  // The owner's handshake is over, admit the next waiting one. Safe to call more than once.
+  void Release(const void *owner);
+
+  // Drop the owner's queued work, wait for its running task and release its slot.
+  // Must not be called from one of the owner's own tasks.
+  void Cancel(const void *owner);
+
+  size_t ActiveHandshakes();
+  size_t QueuedHandshakes();
+
+  ~HandshakePool();
+
+ private:
+  HandshakePool();
+
+  struct Task {
+    const void *owner;
+    std::function<void()> fn;
+  };
+
+  std::mutex mut;
+  std::condition_variable work_cond;
+  std::condition_variable idle_cond;
+
+  std::deque<Task> tasks;
+  std::deque<Task> waiting;
+  std::set<const void *> active;
+  std::multiset<const void *> running;
+
+  std::vector<std::thread> workers;
+  size_t max_active;
+  bool stopping{false};
+
+  void RunWorker();
+  // mut must be held
+  void AdmitWaiting();
+};
+}
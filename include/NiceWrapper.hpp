@@ -32,8 +32,12 @@
  */
 #include <thread>
 
+#include "ChunkPool.hpp"
 #include "ChunkQueue.hpp"
 #include "PeerConnection.hpp"
+#ifndef __WIN32
+#include "UdpMux.hpp"
+#endif // __WIN32
 
 
 extern "C" {
@@ -42,6 +46,20 @@ extern "C" {
 
 namespace rtcdcpp {
 
+// Datagrams handed to libnice per call, which sends them with sendmmsg where available
+#define NICE_SEND_BATCH_SIZE 64
+
+// Smallest receive buffer for batched receive, grown to fit path_mtu and max_path_mtu.
+// Datagrams that do not fit are dropped.
+#define NICE_RECV_BUFFER_SIZE 2048
+
+// Longest wait between receive attempts while libnice keeps reporting errors
+#define NICE_RECV_MAX_BACKOFF_MS 100
+
+// Longest gathering waits for ICE server hostnames to resolve, later ones are left out. All
+// gathering waits, host candidates included, since libnice cannot add servers once it has started.
+#define NICE_RESOLVE_TIMEOUT_MS 2000
+
 /**
  * Nice Wrapper broh.
  */
@@ -58,6 +76,9 @@ class NiceWrapper {
   // Start sending packets XXX: recv just happens once candidates are set
   void StartSendLoop();
 
+  // Start the batched receive thread, a no-op unless RTCTransportConfiguration::receive_batch_size is set
+  void StartRecvLoop();
+
   // Shutdown nice and stop the send thread
   void Stop();
 
@@ -81,6 +102,9 @@ class NiceWrapper {
   // Callback to call when we receive remote data
   void SetDataReceivedCallback(std::function<void(ChunkPtr)>);
 
+  // Callback to call with each batch of remote data, used instead of the above with batched receive
+  void SetBatchReceivedCallback(std::function<void(const std::vector<ChunkPtr> &)>);
+
   // Send data over the nice channel
   void SendData(ChunkPtr chunk);
 
@@ -100,6 +124,7 @@ class NiceWrapper {
   ChunkQueue send_queue;
 
   std::function<void(ChunkPtr)> data_received_callback;
+  std::function<void(const std::vector<ChunkPtr> &)> batch_received_callback;
 
   // Send data thread
   void SendLoop();
@@ -107,6 +132,18 @@ class NiceWrapper {
   std::thread g_main_loop_thread;
   std::atomic<bool> should_stop;
 
+  // Batched receive thread, Stop() cancels its blocking read
+  void RecvLoop();
+  std::thread recv_thread;
+  std::unique_ptr<GCancellable, void (*)(gpointer)> recv_cancellable;
+  ChunkPool recv_pool;
+
+  // Set when RTCTransportConfiguration::udp_mux replaces the agent, never on Windows
+  std::shared_ptr<UdpMux> mux;
+#ifndef __WIN32
+  std::shared_ptr<UdpMux::Peer> mux_peer;
+#endif // __WIN32
+
   // Callback methods
   void OnStateChange(uint32_t stream_id, uint32_t component_id, uint32_t state);
   void OnGatheringDone();
@@ -118,6 +155,18 @@ class NiceWrapper {
   void AddStunServers(const RTCConfiguration &config);
   void AddTurnServers(const RTCConfiguration &config);
 
+  // Server hostnames are resolved off the calling thread, gathering (host candidates included) waits
+  // until all are done or NICE_RESOLVE_TIMEOUT_MS has passed. The rest is guarded by resolve_mutex.
+  std::mutex resolve_mutex;
+  int pending_resolutions{0};
+  bool gather_requested{false};
+  bool gathering_started{false};
+  bool stun_server_set{false};
+  GSource *resolve_timeout{nullptr};
+  void ResolveServer(const std::string &hostname, std::function<void(const std::string &address)> on_resolved);
+  bool GatherCandidates();
+  bool StartGathering();
+
   // Helper functions
   friend void candidate_gathering_done(NiceAgent *agent, guint stream_id, gpointer user_data);
   friend void component_state_changed(NiceAgent *agent, guint stream_id, guint component_id, guint state, gpointer user_data);
@@ -125,6 +174,7 @@ class NiceWrapper {
   friend void new_selected_pair(NiceAgent *agent, guint stream_id, guint component_id, NiceCandidate *lcandidate, NiceCandidate *rcandidate,
                                 gpointer user_data);
   friend void data_received(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer user_data);
+  friend gboolean resolve_timeout_expired(gpointer user_data);
   friend void nice_log_handler(const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data);
 };
 }
@@ -28,7 +28,9 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <map>
+#include <mutex>
 
 #include "ChunkQueue.hpp"
 #include "DataChannel.hpp"
@@ -44,21 +46,36 @@ namespace rtcdcpp {
   class NiceWrapper;
   class DTLSWrapper;
   class SCTPWrapper;
+  class UdpMux;
 
+  // How a TURN server is reached, STUN servers are always queried over UDP
+  enum class IceTransport {
+      UDP
+      , TCP
+      , TLS
+  };
+
+  // A STUN or TURN server, see RTCConfiguration. Of the STUN servers only one is used: libnice queries
+  // a single STUN server per agent, so server reflexive candidates come from the first one that resolves
+  // and the rest are not even tried as fallbacks. TURN servers are all used, and each allocation also
+  // yields a server reflexive candidate, so list a TURN server where a second source is needed.
   struct RTCIceServer {
       RTCIceServer()
           : hostname_()
           , port_(0)
+          , transport_(IceTransport::UDP)
       {
       }
-      RTCIceServer(const std::string &hostname, int port)
+      RTCIceServer(const std::string &hostname, int port, IceTransport transport = IceTransport::UDP)
           : hostname_(hostname)
           , port_(port)
+          , transport_(transport)
       {
       }
 
     std::string hostname_;
     int port_;
+    IceTransport transport_;
   };
 
   std::ostream &operator<<(std::ostream &os, const RTCIceServer &ice_server);
@@ -88,6 +105,7 @@ namespace rtcdcpp {
       }
 
     IceServerType type;
+    // Only the first STUN server that resolves is used, see RTCIceServer
     std::vector<RTCIceServer> ice_servers;
     std::string ice_ufrag;
     std::string ice_pwd;
@@ -95,6 +113,175 @@ namespace rtcdcpp {
 
   using IceConfig = std::vector<RTCConfiguration>;
 
+  enum class DtlsCipherPolicy {
+      // ECDHE with AEAD first: AES-128-GCM when the CPU has AES instructions, ChaCha20-Poly1305 otherwise
+      Auto
+      , AesGcmFirst
+      , ChaCha20First
+      // The historical "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH" list, which may negotiate CBC+HMAC suites
+      , Legacy
+  };
+
+  struct RTCDtlsConfiguration {
+    DtlsCipherPolicy cipher_policy{DtlsCipherPolicy::Auto};
+    // OpenSSL cipher string that replaces cipher_policy when not empty
+    std::string cipher_list;
+    // Handshake flights are resent after the initial timeout, doubling up to the maximum.
+    // OpenSSL gives up after 12 timeouts.
+    std::chrono::milliseconds retransmit_initial_timeout{250};
+    std::chrono::milliseconds retransmit_max_timeout{8000};
+  };
+
+  // usrsctp stream schedulers, deciding which stream's data goes out next
+  enum class SctpStreamScheduler {
+      FirstCome
+      , RoundRobin
+      // Round robin per packet instead of per chunk
+      , RoundRobinPacket
+      // Strictly by DataChannel priority, channels of equal priority share round robin
+      , Priority
+      // Equal bandwidth per stream, regardless of message sizes
+      , FairBandwidth
+  };
+
+  // usrsctp congestion control modules
+  enum class SctpCongestionControl {
+      // Standard loss-based NewReno
+      Rfc2581
+      // Loss-based, grows faster on high bandwidth-delay links
+      , HighSpeedTcp
+      , HTcp
+      // Delay-based, keeps queues and therefore latency short
+      , RealTime
+  };
+
+  struct RTCSctpConfiguration {
+    // Negotiate user message interleaving (I-DATA, RFC 8260), so a large message on one channel
+    // does not hold up the others. Falls back to plain DATA chunks if the peer does not support it.
+    bool message_interleaving{true};
+    SctpStreamScheduler scheduler{SctpStreamScheduler::RoundRobin};
+    // Larger messages are handed up in pieces as they arrive, see DataChannel::SetOnFragmentCallback.
+    // Zero keeps the usrsctp default.
+    uint32_t partial_delivery_point{64 * 1024};
+    // Streams requested in each direction when the association starts. More are added on demand
+    // when a data channel needs a higher stream id, up to max_streams (RFC 6525).
+    uint16_t initial_streams{256};
+    uint16_t max_streams{65535};
+    // Largest message we accept, advertised as a=max-message-size. Zero means no limit.
+    uint32_t max_message_size{256 * 1024};
+
+    // Socket buffers in bytes, zero keeps the usrsctp default. The receive buffer bounds the
+    // receive window, so it should cover the bandwidth-delay product for bulk transfers.
+    uint32_t send_buffer{0};
+    uint32_t receive_buffer{0};
+    SctpCongestionControl congestion_control{SctpCongestionControl::Rfc2581};
+    // Run message and notification handlers on a dedicated delivery thread that drains the socket
+    // in batches, instead of inside usrsctp. A slow handler then no longer holds up SACKs and timers.
+    bool receive_upcall{false};
+    // Let small messages share packets instead of sending each at once. They are held until a packet's
+    // worth has gathered, the first has waited bundling_max_delay, PeerConnection::Flush() is called
+    // or an unbundled message is sent, then handed to SCTP together. A held message that cannot be
+    // sent only shows in RTCSctpStats::sends_failed. See DataChannel::SetBundled for channels that should not wait.
+    bool bundling{false};
+    std::chrono::milliseconds bundling_max_delay{20};
+
+    // Bulk transfers over links with a large bandwidth-delay product. A larger initial congestion
+    // window helps too, see PeerConnection::SetSctpInitialCwnd.
+    static RTCSctpConfiguration HighThroughput() {
+      RTCSctpConfiguration config;
+      config.send_buffer = 4 * 1024 * 1024;
+      config.receive_buffer = 4 * 1024 * 1024;
+      config.congestion_control = SctpCongestionControl::HTcp;
+      return config;
+    }
+
+    // Interactive traffic, where queueing delay matters more than throughput
+    static RTCSctpConfiguration LowLatency() {
+      RTCSctpConfiguration config;
+      config.send_buffer = 256 * 1024;
+      config.receive_buffer = 256 * 1024;
+      config.congestion_control = SctpCongestionControl::RealTime;
+      config.scheduler = SctpStreamScheduler::Priority;
+      return config;
+    }
+  };
+
+  /**
+   * Per-connection tuning of the transports below the data channels.
+   * The defaults are suitable for most connections.
+   */
+  struct RTCTransportConfiguration {
+    RTCDtlsConfiguration dtls;
+    RTCSctpConfiguration sctp;
+    // Largest UDP payload we send, DTLS records and SCTP packets are sized to fit
+    uint16_t path_mtu{1200};
+    // When larger than path_mtu, probe for bigger datagrams up to this size once connected
+    // and raise the MTU when they get through (RFC 8899). Zero disables probing.
+    uint16_t max_path_mtu{0};
+    // When non-zero, read datagrams on a dedicated thread in batches of up to this many into pooled
+    // buffers, and hand each batch to DTLS at once. Zero receives each datagram through a GMainLoop callback.
+    uint16_t receive_batch_size{0};
+    // Start gathering ICE candidates when the PeerConnection is created, so STUN and TURN round
+    // trips overlap with signalling. When false, gathering waits for the remote description.
+    // libnice gathers host, server reflexive and relay candidates in one go, so while ICE server
+    // hostnames resolve even host candidates are held back, for up to NICE_RESOLVE_TIMEOUT_MS.
+    // Give servers as IP addresses to avoid the wait.
+    bool gather_on_initialize{true};
+    // Run ICE-lite (RFC 8445 section 2.5), for servers with a public address: only host candidates,
+    // no STUN or TURN, and connectivity checks are answered but never sent. The remote must run full ICE.
+    bool ice_lite{false};
+    // Serve this connection from sockets shared with other PeerConnections instead of its own libnice agent.
+    // Implies ICE-lite, STUN and TURN servers are ignored. Not available on Windows.
+    std::shared_ptr<UdpMux> udp_mux;
+  };
+
+  struct RTCDtlsStats {
+    // Negotiated suite and protocol, empty until the handshake completes
+    std::string cipher_suite;
+    std::string protocol_version;
+    // Whether this host has AES instructions, which makes AES-GCM the cheapest suite
+    bool aes_hardware{false};
+    // From ICE ready to handshake completion, zero until the handshake completes
+    std::chrono::milliseconds handshake_duration{0};
+    uint32_t handshake_retransmits{0};
+    bool handshake_failed{false};
+  };
+
+  struct RTCSctpStats {
+    // From SCTP_STATUS, zero until the association is up
+    int32_t state{0};
+    uint32_t peer_rwnd{0};
+    uint16_t unacked_chunks{0};
+    uint16_t pending_chunks{0};
+    uint16_t inbound_streams{0};
+    uint16_t outbound_streams{0};
+    // The only path of the association
+    uint32_t cwnd{0};
+    std::chrono::milliseconds srtt{0};
+    std::chrono::milliseconds rto{0};
+    uint32_t mtu{0};
+    // SCTP packets exchanged with DTLS
+    uint64_t packets_sent{0};
+    uint64_t packets_received{0};
+    uint64_t bytes_sent{0};
+    uint64_t bytes_received{0};
+    // Messages that found the send buffer full at least once, the 1 ms retries that took, and the messages given up on
+    uint64_t sends_would_block{0};
+    uint64_t send_retries{0};
+    uint64_t sends_failed{0};
+    // DATA chunks sent again with a TSN already sent, and their user data bytes.
+    // usrsctp keeps no per-association retransmission count, so these come from the outgoing packets.
+    uint64_t retransmitted_chunks{0};
+    uint64_t retransmitted_bytes{0};
+  };
+
+  struct RTCTransportStats {
+    RTCDtlsStats dtls;
+    RTCSctpStats sctp;
+    // Largest UDP payload currently sent, including anything probing has found
+    uint16_t path_mtu{0};
+  };
+
   class EXPORT PeerConnection {
     friend class DTLSWrapper;
     friend class DataChannel;
@@ -107,14 +294,35 @@ namespace rtcdcpp {
       int sdpMLineIndex;
     };
 
+    // Local candidates are held back until GenerateOffer() or ParseOffer(), so they carry the right sdpMid.
+    // The callback must not call either of them.
     using IceCandidateCallbackPtr = std::function<void(IceCandidate)>;
     using DataChannelCallbackPtr = std::function<void(std::shared_ptr<DataChannel> channel)>;
 
-    PeerConnection(const IceConfig &config, IceCandidateCallbackPtr icCB, DataChannelCallbackPtr dcCB);
+    PeerConnection(const IceConfig &config, IceCandidateCallbackPtr icCB, DataChannelCallbackPtr dcCB,
+                   const RTCTransportConfiguration &transport_config = RTCTransportConfiguration());
 
     virtual ~PeerConnection();
 
     const IceConfig& Config() const noexcept { return config_; }
+    const RTCTransportConfiguration& TransportConfig() const noexcept { return transport_config_; }
+
+    /**
+     * Initial congestion window, in MTUs, of SCTP associations started from now on. Zero restores the
+     * usrsctp default. This is process-wide, usrsctp has no per-association setting for it.
+     */
+    static void SetSctpInitialCwnd(uint32_t mtus);
+
+    /**
+     * Snapshot of the transport state, e.g. the negotiated DTLS cipher suite.
+     */
+    RTCTransportStats GetTransportStats() const;
+
+    /**
+     * Largest message the remote accepts, from its a=max-message-size.
+     * 65536 if it did not say, zero if it has no limit.
+     */
+    uint32_t GetRemoteMaxMessageSize() const noexcept { return remote_max_message_size; }
 
     /**
      *
@@ -150,7 +358,8 @@ namespace rtcdcpp {
      * TODO: Handle creating data channels before generating SDP, so that the
      *       data channel is created as part of the connection process.
      */
-    std::shared_ptr<DataChannel> CreateDataChannel(std::string label, std::string protocol="", uint8_t chan_type=DATA_CHANNEL_RELIABLE, uint32_t reliability=0);
+    std::shared_ptr<DataChannel> CreateDataChannel(std::string label, std::string protocol="", uint8_t chan_type=DATA_CHANNEL_RELIABLE, uint32_t reliability=0,
+                                                   uint16_t priority=DATA_CHANNEL_PRIORITY_NORMAL);
 
     /**
      * Notify when remote party creates a DataChannel.
@@ -160,23 +369,53 @@ namespace rtcdcpp {
      */
     //  void SetDataChannelCreatedCallback(DataChannelCallbackPtr cb);
 
-    // TODO: Error callbacks
+    /**
+     * Notify when the connection fails, e.g. because the DTLS handshake did not complete.
+     * Runs on an internal thread, the PeerConnection must not be destroyed from within it.
+     */
+    void SetOnErrorCallback(std::function<void(std::string description)> error_cb);
+
+    /**
+     * Close many data channels at once, with one stream reset request.
+     * Each channel's closed callback fires once both directions of its stream are reset,
+     * after which the connection drops the channel and may reuse its stream id.
+     */
+    void CloseDataChannels(const std::vector<uint16_t> &stream_ids);
 
     void SendStrMsg(std::string msg, uint16_t sid);
     void SendBinaryMsg(const uint8_t *data, int len, uint16_t sid);
+    void SendBinaryFragment(const uint8_t *data, int len, uint16_t sid, bool is_last);
     void StopSendData();
 
+    /**
+     * Send the messages held for RTCSctpConfiguration::bundling now, e.g. at the end of a burst.
+     */
+    void Flush();
+
     /* Internal Callback Handlers */
     void OnLocalIceCandidate(std::string &ice_candidate);
     void OnIceReady();
     void OnDTLSHandshakeDone();
-    void OnSCTPMsgReceived(ChunkPtr chunk, uint16_t sid, uint32_t ppid);
+    void OnDTLSHandshakeFailed();
+    void OnSCTPMsgReceived(ChunkPtr chunk, uint16_t sid, uint32_t ppid, bool is_last = true);
 
     private:
     IceConfig config_;
+    RTCTransportConfiguration transport_config_;
     const IceCandidateCallbackPtr ice_candidate_cb;
     const DataChannelCallbackPtr new_channel_cb;
+    std::function<void(std::string description)> error_cb;
+    // The media id local candidates are reported with, known once an offer was generated or a remote
+    // description parsed. Candidates found earlier wait in early_candidates. mid_mutex guards all three,
+    // candidates_mutex keeps candidates in order while they are handed to ice_candidate_cb.
+    std::mutex mid_mutex;
     std::string mid;
+    bool mid_known{false};
+    std::vector<std::string> early_candidates;
+    std::mutex candidates_mutex;
+    void ReleaseEarlyCandidates();
+    // RFC 8841 default when the remote does not send a=max-message-size
+    uint32_t remote_max_message_size{65536};
 
     enum Role { Client, Server } role = Client;
 
@@ -185,8 +424,15 @@ namespace rtcdcpp {
     std::unique_ptr<DTLSWrapper> dtls;
     std::unique_ptr<SCTPWrapper> sctp;
 
+    // Guards data_channels, which the app, SCTP receive and SCTP open threads all touch
+    std::mutex channels_mutex;
     std::map<uint16_t, std::shared_ptr<DataChannel>> data_channels;
     std::shared_ptr<DataChannel> GetChannel(uint16_t sid);
+    // Drop sid from data_channels if it still maps to channel, so its stream id can be reused
+    void RemoveChannel(uint16_t sid, const std::shared_ptr<DataChannel> &channel);
+
+    // Pieces of partially delivered messages, for channels that want them whole
+    std::map<uint16_t, std::vector<ChunkPtr>> partial_messages;
 
     /**
      * Constructor helper
@@ -30,6 +30,8 @@
 /**
  * Wrapper around usrsctp.
  */
+#include <deque>
+#include <set>
 #include <thread>
 
 #include "usrsctp.h"
@@ -39,32 +41,71 @@
 
 namespace rtcdcpp {
 
-#define MAX_OUT_STREAM 256
-#define MAX_IN_STREAM 256
+// Path MTU probing: wait per probe, probes per size before giving up on it, and precision of the search
+#define SCTP_PROBE_TIMEOUT_MS 1000
+#define SCTP_PROBE_MAX_ATTEMPTS 3
+#define SCTP_PROBE_GRANULARITY 16
 
+// usrsctp's initial congestion window in MTUs, its SCTPCTL_INITIAL_CWND_DEFAULT is not exported
+#define SCTP_INITIAL_CWND_DEFAULT 3
+
+// Largest piece usrsctp_recvv hands the delivery thread at once, longer messages arrive in several
+#define SCTP_DELIVERY_BUFFER_SIZE (64 * 1024)
+
+// SCTP packet layout, for bundling and counting retransmissions
+#define SCTP_COMMON_HEADER_LEN 12
+#define SCTP_DATA_HEADER_LEN 16
 
 class SCTPWrapper {
  public:
-  using MsgReceivedCallbackPtr = std::function<void(ChunkPtr chunk, uint16_t sid, uint32_t ppid)>;
+  // is_last is false for all but the final piece of a partially delivered message.
+  // chunk is null when the partial delivery of the message on sid was aborted.
+  using MsgReceivedCallbackPtr = std::function<void(ChunkPtr chunk, uint16_t sid, uint32_t ppid, bool is_last)>;
   using DTLSEncryptCallbackPtr = std::function<void(ChunkPtr)>;
 
-  SCTPWrapper(DTLSEncryptCallbackPtr dtlsEncryptCB, MsgReceivedCallbackPtr msgReceivedCB);
+  SCTPWrapper(DTLSEncryptCallbackPtr dtlsEncryptCB, MsgReceivedCallbackPtr msgReceivedCB,
+              const RTCSctpConfiguration &config = RTCSctpConfiguration());
   virtual ~SCTPWrapper();
 
+  // Process-wide, applied to every association created afterwards. Zero keeps the usrsctp default.
+  static void SetInitialCwnd(uint32_t mtus);
+
   bool Initialize();
   void Start();
   void Stop();
   void ResetSCTPStream(uint16_t stream_id, uint16_t srs_flags);
+  // Reset many streams with a single request
+  void ResetSCTPStreams(const std::vector<uint16_t> &stream_ids, uint16_t srs_flags);
   //  int GetStreamCursor();
   //  void SetStreamCursor(int i);
 
-  // Handle a decrypted SCTP packet
-  void DTLSForSCTP(ChunkPtr chunk);
+  // Handle a batch of decrypted SCTP packets
+  void DTLSForSCTP(const std::vector<ChunkPtr> &chunks);
   
-  void SendACK(uint8_t chan_type, uint32_t reliability);
-  void CreateDCForSCTP(std::string label, std::string protocol="", uint8_t chan_type = DATA_CHANNEL_RELIABLE, uint32_t reliability = 0);
+  void SendACK(uint16_t sid);
+  // Send the open request for a new data channel from the open thread, once the association is up and
+  // stream sid exists. If that fails, on_failed is called there with the reason, unless Stop() came first.
+  void CreateDCForSCTP(uint16_t sid, std::string label, std::string protocol, uint8_t chan_type, uint32_t reliability, uint16_t priority,
+                       std::function<void(const std::string &error)> on_failed);
+
+  // Apply a DataChannel priority to its stream, needs an established association
+  void SetStreamPriority(uint16_t sid, uint16_t priority);
+
+  // Make sure stream sid exists in both directions, adding streams if needed.
+  // Blocks until the peer has answered, returns false if it refused or sid is beyond max_streams.
+  bool EnsureStream(uint16_t sid);
 
-  dc_open_msg *data;
+  // The path MTU is the largest UDP payload, SCTP packets leave room for the DTLS record overhead.
+  // Call before Start(). If max_path_mtu is larger, it is probed for once the association is up.
+  void SetPathMtu(uint16_t path_mtu, uint16_t record_overhead, uint16_t max_path_mtu = 0);
+  // Called on the receive thread whenever probing raises the path MTU
+  void SetPathMtuCallback(std::function<void(uint16_t path_mtu)> path_mtu_callback);
+  uint16_t GetPathMtu() const { return path_mtu; }
+
+  // One SCTP_STATUS query plus relaxed counters, cheap enough to poll often
+  RTCSctpStats GetStats() const;
+
+  dc_open_msg *data{nullptr};
   uint16_t sid;
   std::string label;
   std::string protocol;
@@ -76,13 +117,20 @@ class SCTPWrapper {
   void SetDataChannelSID(uint16_t sid);
 
   // Send a message to the remote connection
+  // Ordering and partial reliability (max retransmissions or lifetime in ms) follow the channel's chan_type
+  // Unless is_last, the chunk is only the start of a message and the next call on sid continues it
+  // With RTCSctpConfiguration::bundling, an unbundled send goes out at once and takes any held data along
   // Note, this will cause 1+ DTLSEncrypt callback calls
-  void GSForSCTP(ChunkPtr chunk, uint16_t sid, uint32_t ppid);
+  void GSForSCTP(ChunkPtr chunk, uint16_t sid, uint32_t ppid, uint8_t chan_type = DATA_CHANNEL_RELIABLE, uint32_t reliability = 0,
+                 bool is_last = true, bool bundled = true);
   void StopSend();
 
+  // Send the messages held for RTCSctpConfiguration::bundling now, a no-op without it.
+  void Flush();
+
  private:
   //  PeerConnection *peer_connection;
-  uint32_t reliability;
+  const RTCSctpConfiguration config;
   bool started{false};
   struct socket *sock;
   uint16_t local_port;
@@ -97,6 +145,15 @@ class SCTPWrapper {
   std::mutex createDCMtx;
   std::condition_variable createDC;
 
+  // Open requests run one at a time on open_thread, since each may wait for the peer to add streams
+  std::thread open_thread;
+  std::mutex open_mutex;
+  std::condition_variable open_cv;
+  std::deque<std::function<void()>> open_requests;
+  void RunOpen();
+  bool OpenDataChannel(uint16_t sid, const std::string &label, const std::string &protocol, uint8_t chan_type, uint32_t reliability,
+                       uint16_t priority, std::string &error);
+
   ChunkQueue send_queue;
   ChunkQueue recv_queue;
 
@@ -104,11 +161,107 @@ class SCTPWrapper {
   const MsgReceivedCallbackPtr msgReceivedCallback;
 
   std::atomic<bool> should_stop{false};
+
+  static std::atomic<uint32_t> initial_cwnd;
   std::thread recv_thread;
   std::thread connect_thread;
 
   std::atomic<bool> shouldSend{true};
 
+  // Counters for GetStats(), only ever read for reporting
+  std::atomic<uint64_t> packets_sent{0};
+  std::atomic<uint64_t> packets_received{0};
+  std::atomic<uint64_t> bytes_sent{0};
+  std::atomic<uint64_t> bytes_received{0};
+  std::atomic<uint64_t> sends_would_block{0};
+  std::atomic<uint64_t> send_retries{0};
+  std::atomic<uint64_t> sends_failed{0};
+  std::atomic<uint64_t> retransmitted_chunks{0};
+  std::atomic<uint64_t> retransmitted_bytes{0};
+  // Highest DATA TSN handed to DTLS so far, usrsctp serialises the output calls of an association
+  bool tsn_sent{false};
+  uint32_t highest_tsn_sent{0};
+  void CountRetransmissions(const uint8_t *packet, size_t len);
+
+  // Keeps GetStats() from querying sock while Stop() closes it
+  mutable std::mutex sock_mutex;
+
+  // Upcall mode: usrsctp only signals readability, delivery_thread drains the socket and runs the handlers
+  std::thread delivery_thread;
+  std::mutex delivery_mutex;
+  std::condition_variable delivery_cv;
+  bool readable{false};
+  void RunDelivery();
+  void OnSCTPUpcall(int events);
+
+  // Bundling: small messages wait in held until a packet's worth has gathered, then go to usrsctp
+  // together. flush_thread sends them once the first is bundling_max_delay old.
+  // bundle_mutex guards held and nodelay, which mirrors the socket's SCTP_NODELAY so it is only set when it changes.
+  struct HeldMessage {
+    ChunkPtr chunk;
+    uint16_t sid;
+    uint32_t ppid;
+    uint8_t chan_type;
+    uint32_t reliability;
+  };
+  std::mutex bundle_mutex;
+  std::vector<HeldMessage> held;
+  size_t held_bytes{0};
+  bool nodelay{true};
+  std::thread flush_thread;
+  std::mutex flush_mutex;
+  std::condition_variable flush_cv;
+  bool flush_pending{false};
+  std::chrono::steady_clock::time_point flush_deadline;
+  void RunFlush();
+  void ScheduleFlush();
+  void SendHeld();
+  bool SetNoDelay(bool nodelay);
+  enum SendResult { SendOk, SendFailed, SendCancelled };
+  SendResult SendNow(ChunkPtr chunk, uint16_t sid, uint32_t ppid, uint8_t chan_type, uint32_t reliability, bool is_last);
+
+  // outgoing_reset holds the streams we have asked to reset, outgoing_reset_done those the peer confirmed.
+  // A stream is closed, and free again, once both directions are reset.
+  // Resets requested while another request is outstanding wait in pending_resets.
+  std::mutex reset_mutex;
+  std::set<uint16_t> outgoing_reset;
+  std::set<uint16_t> outgoing_reset_done;
+  std::set<uint16_t> incoming_reset;
+  std::vector<uint16_t> pending_resets;
+
+  // Negotiated stream counts, guarded by streams_mutex
+  std::mutex streams_mutex;
+  std::condition_variable streams_cv;
+  uint16_t outbound_streams{0};
+  uint16_t inbound_streams{0};
+  bool streams_change_pending{false};
+  bool streams_change_failed{false};
+  // Totals our outstanding SCTP_ADD_STREAMS asks for, to tell its answer from streams the peer adds
+  uint16_t streams_requested_out{0};
+  uint16_t streams_requested_in{0};
+
+  std::atomic<uint16_t> path_mtu{1200};
+  uint16_t record_overhead{0};
+  std::function<void(uint16_t path_mtu)> path_mtu_callback;
+  bool ApplyPathMtu();
+
+  // Packetization layer PMTU discovery (RFC 8899) with HEARTBEAT+PAD probes, driven by the recv thread.
+  // Sizes between path_mtu and probe_high are still unknown, probe_size is in flight.
+  std::atomic<bool> assoc_up{false};
+  std::atomic<uint32_t> peer_vtag{0};
+  uint16_t probe_max_mtu{0};
+  // Exclusive upper bound, one past probe_max_mtu at first, so it must hold 65536
+  uint32_t probe_high{0};
+  uint16_t probe_size{0};
+  uint32_t probe_nonce{0};
+  int probe_attempts{0};
+  std::chrono::steady_clock::time_point probe_deadline;
+
+  void SendProbe();
+  void NextProbe();
+  void OnProbeTimeout();
+  bool IsProbeAck(const uint8_t *packet, size_t len);
+
   void RunConnect();
   void RecvLoop();
 
@@ -118,12 +271,15 @@ class SCTPWrapper {
   // SCTP has received a packet for GameSurge
   int OnSCTPForGS(struct socket *sock, union sctp_sockstore addr, void *data, size_t len, struct sctp_rcvinfo recv_info, int flags);
 
-  void OnMsgReceived(const uint8_t *data, size_t len, int ppid, int sid);
+  void OnMsgReceived(ChunkPtr chunk, uint16_t sid, uint32_t ppid, bool is_last = true);
   void OnNotification(union sctp_notification *notify, size_t len);
+  void OnStreamReset(const struct sctp_stream_reset_event *reset_event);
+  void SendStreamReset(const std::vector<uint16_t> &stream_ids, uint16_t srs_flags);
 
   // usrsctp callbacks
   static int _OnSCTPForDTLS(void *sctp_ptr, void *data, size_t len, uint8_t tos, uint8_t set_df);
   static void _DebugLog(const char *format, ...);
+  static void _OnSCTPUpcall(struct socket *sock, void *arg, int flags);
   static int _OnSCTPForGS(struct socket *sock, union sctp_sockstore addr, void *data, size_t len, struct sctp_rcvinfo recv_info, int flags,
                           void *user_data);
 };
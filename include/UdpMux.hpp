@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+/**
+ * UDP sockets shared by many PeerConnections.
+ * POSIX only, not built on Windows.
+ */
+#ifndef __WIN32
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "ChunkPool.hpp"
+
+#ifdef __MINGW32__
+#define EXPORT __attribute__((dllexport))
+#else
+#define EXPORT
+#endif //__MINGW32__
+
+namespace rtcdcpp {
+
+// Datagrams read or written per recvmmsg/sendmmsg call
+#define UDP_MUX_BATCH_SIZE 32
+// Receive buffer per datagram, larger datagrams are dropped. Path MTU probes above it fail, so
+// max_path_mtu settles below it.
+#define UDP_MUX_BUFFER_SIZE 2048
+// Kernel buffer of each socket, shared by all of its peers
+#define UDP_MUX_SOCKET_BUFFER (4 * 1024 * 1024)
+
+/**
+ * Serves any number of peers from one UDP port, as an ICE-lite agent (RFC 8445 section 2.5).
+ *
+ * Several sockets, by default one per hardware thread, are bound to the port with SO_REUSEPORT,
+ * so the kernel spreads remotes across them. STUN binding requests are routed to their peer by
+ * the local username fragment and answered here. The first authenticated one selects the peer's
+ * remote address, after which all other datagrams from that address go to the peer.
+ *
+ * Pass it to PeerConnections through RTCTransportConfiguration::udp_mux. POSIX only.
+ */
+class EXPORT UdpMux {
+ public:
+  /**
+   * One peer's ICE state on the mux, see Register.
+   */
+  class Peer {
+    friend class UdpMux;
+
+   public:
+    const std::string &LocalUfrag() const { return ufrag; }
+    const std::string &LocalPwd() const { return pwd; }
+
+   private:
+    std::string ufrag;
+    std::string pwd;
+
+    // Guards the callbacks, Unregister clears active under it
+    std::mutex callback_mutex;
+    bool active{true};
+    bool ready{false};
+    std::function<void()> on_ready;
+    std::function<void(ChunkPtr)> on_data;
+
+    // Selected remote address and the socket its checks arrived on
+    std::mutex address_mutex;
+    int fd{-1};
+    struct sockaddr_storage remote;
+    socklen_t remote_len{0};
+  };
+
+  /**
+   * Bind sockets to address and port, zero sockets means one per hardware thread and port zero any free port.
+   * public_address goes into host candidates and defaults to address, it must be set when binding a wildcard address.
+   * Throws std::runtime_error if the sockets cannot be set up.
+   */
+  UdpMux(const std::string &address, uint16_t port, size_t sockets = 0, const std::string &public_address = "");
+  virtual ~UdpMux();
+
+  uint16_t Port() const { return port; }
+
+  // Host candidate for the shared port, without the leading a=
+  std::string CandidateSdp() const;
+
+  /**
+   * Add a peer with fresh ICE credentials. on_ready is called once the first authenticated check
+   * has arrived, on_data with every other datagram from the selected address.
+   * Both run on a socket thread.
+   */
+  std::shared_ptr<Peer> Register(std::function<void()> on_ready, std::function<void(ChunkPtr)> on_data);
+
+  // No callback runs for peer once this returns. Must not be called from the peer's own callbacks.
+  void Unregister(const std::shared_ptr<Peer> &peer);
+
+  // Send datagrams to the peer's selected address. Returns how many were sent, or -1 with errno set.
+  int Send(Peer &peer, const ChunkPtr *chunks, size_t count);
+
+ private:
+  // Raw port and address bytes, IPv4-mapped IPv6 addresses are stored as IPv4
+  struct AddressKey {
+    uint8_t bytes[18];
+    uint8_t len;
+    bool operator==(const AddressKey &other) const { return len == other.len && memcmp(bytes, other.bytes, len) == 0; }
+  };
+  struct AddressHash {
+    size_t operator()(const AddressKey &key) const;
+  };
+  static bool MakeKey(const struct sockaddr_storage &address, AddressKey &key);
+
+  std::string public_address;
+  uint16_t port{0};
+
+  // Guards both tables
+  std::mutex mut;
+  std::unordered_map<std::string, std::shared_ptr<Peer>> by_ufrag;
+  std::unordered_map<AddressKey, std::shared_ptr<Peer>, AddressHash> by_address;
+
+  std::vector<int> fds;
+  std::vector<std::thread> readers;
+  std::atomic<bool> stopping{false};
+  ChunkPool pool;
+
+  void RunReader(int fd);
+  void OnDatagram(int fd, ChunkPtr datagram, const struct sockaddr_storage &from, socklen_t from_len);
+  void OnBindingRequest(int fd, const uint8_t *msg, size_t len, const struct sockaddr_storage &from, socklen_t from_len);
+  std::shared_ptr<Peer> FindByUfrag(const std::string &ufrag);
+  std::shared_ptr<Peer> FindByAddress(const struct sockaddr_storage &from);
+};
+}
+
+#endif // __WIN32
@@ -29,13 +29,21 @@
  * Simple wrapper around OpenSSL DTLS.
  */
 
+#include <algorithm>
 #include <iostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
 
 #include "openssl/bio.h"
 #include "openssl/ec.h"
 #include "openssl/ssl.h"
 
 #include "DTLSWrapper.hpp"
+#include "HandshakePool.hpp"
 
 
 namespace rtcdcpp {
@@ -45,10 +53,13 @@ using namespace std;
 DTLSWrapper::DTLSWrapper(PeerConnection *peer_connection)
     : peer_connection(peer_connection)
     , certificate_(RTCCertificate::GenerateCertificate("rtcdcpp", 365))
+    , should_stop(false)
+    , out_pool(2048, 64)
+    , in_pool(2048, 64)
     , handshake_complete(false)
-    , should_stop(false) {
-  this->decrypted_callback = [](ChunkPtr x) { ; };
-  this->encrypted_callback = [](ChunkPtr x) { ; };
+    , handshake_wakeup(std::make_shared<Chunk>(0)) {
+  this->decrypted_callback = [](const std::vector<ChunkPtr> &) { ; };
+  this->encrypted_callback = [](ChunkPtr) { ; };
 }
 
 DTLSWrapper::~DTLSWrapper() {
@@ -69,11 +80,57 @@ DTLSWrapper::~DTLSWrapper() {
   }
 }
 
-static int verify_peer_certificate(int ok, X509_STORE_CTX *ctx) {
+static int verify_peer_certificate(int /*ok*/, X509_STORE_CTX * /*ctx*/) {
   // XXX: This function should ask the user if they trust the cert
   return 1;
 }
 
+// AES-GCM is only the cheapest AEAD when the CPU can run AES in hardware; without it ChaCha20-Poly1305 is several times faster.
+static bool DetectAesHardware() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES);
+#elif defined(__aarch64__) && defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__aarch64__) && defined(__APPLE__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+static bool HasAesHardware() {
+  static const bool aes_hardware = DetectAesHardware();
+  return aes_hardware;
+}
+
+#define DTLS_CIPHERS_AES_GCM "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256"
+#define DTLS_CIPHERS_CHACHA20 "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+// AES-256-GCM for peers that disabled the AES-128 suites, then CBC suites only for peers without any AEAD suite
+#define DTLS_CIPHERS_FALLBACK "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA"
+#define DTLS_CIPHERS_LEGACY "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH"
+
+static std::string CipherList(const RTCDtlsConfiguration &config, bool aes_hardware) {
+  if (!config.cipher_list.empty()) {
+    return config.cipher_list;
+  }
+
+  switch (config.cipher_policy) {
+    case DtlsCipherPolicy::Legacy:
+      return DTLS_CIPHERS_LEGACY;
+    case DtlsCipherPolicy::AesGcmFirst:
+      return DTLS_CIPHERS_AES_GCM ":" DTLS_CIPHERS_CHACHA20 ":" DTLS_CIPHERS_FALLBACK;
+    case DtlsCipherPolicy::ChaCha20First:
+      return DTLS_CIPHERS_CHACHA20 ":" DTLS_CIPHERS_AES_GCM ":" DTLS_CIPHERS_FALLBACK;
+    case DtlsCipherPolicy::Auto:
+    default:
+      if (aes_hardware) {
+        return DTLS_CIPHERS_AES_GCM ":" DTLS_CIPHERS_CHACHA20 ":" DTLS_CIPHERS_FALLBACK;
+      }
+      return DTLS_CIPHERS_CHACHA20 ":" DTLS_CIPHERS_AES_GCM ":" DTLS_CIPHERS_FALLBACK;
+  }
+}
+
 bool DTLSWrapper::Initialize() {
   SSL_library_init();
   OpenSSL_add_all_algorithms();
@@ -83,10 +140,22 @@ bool DTLSWrapper::Initialize() {
     return false;
   }
 
-  if (SSL_CTX_set_cipher_list(ctx, "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH") != 1) {
+  const RTCDtlsConfiguration &config = peer_connection->TransportConfig().dtls;
+  if (SSL_CTX_set_cipher_list(ctx, CipherList(config, HasAesHardware()).c_str()) != 1) {
     return false;
   }
 
+  if (config.cipher_policy != DtlsCipherPolicy::Legacy) {
+    // When we are the DTLS server our order wins, except that a client which puts ChaCha20 first
+    // (typically one without AES instructions) gets ChaCha20.
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_PRIORITIZE_CHACHA
+    if (config.cipher_policy == DtlsCipherPolicy::Auto) {
+      SSL_CTX_set_options(ctx, SSL_OP_PRIORITIZE_CHACHA);
+    }
+#endif
+  }
+
   SSL_CTX_set_read_ahead(ctx, 1);
   SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_peer_certificate);
   SSL_CTX_use_PrivateKey(ctx, certificate_.evp_pkey());
@@ -101,19 +170,26 @@ bool DTLSWrapper::Initialize() {
     return false;
   }
 
-  in_bio = BIO_new(BIO_s_mem());
-  if (!in_bio) {
+  BIO_METHOD *method = DatagramBIOMethod();
+  if (!method) {
     return false;
   }
-  BIO_set_mem_eof_return(in_bio, -1);
-
-  out_bio = BIO_new(BIO_s_mem());
-  if (!out_bio) {
+  bio = BIO_new(method);
+  if (!bio) {
     return false;
   }
-  BIO_set_mem_eof_return(out_bio, -1);
+  BIO_set_data(bio, this);
 
-  SSL_set_bio(ssl, in_bio, out_bio);
+  // The same BIO reads and writes, SSL_set_bio takes a single reference for it
+  SSL_set_bio(ssl, bio, bio);
+
+  SSL_set_app_data(ssl, this);
+  DTLS_set_timer_cb(ssl, &DTLSWrapper::_OnDTLSTimer);
+
+  // We know the datagram size, don't let OpenSSL probe for it
+  SSL_set_options(ssl, SSL_OP_NO_QUERY_MTU);
+  link_mtu = peer_connection->TransportConfig().path_mtu;
+  DTLS_set_link_mtu(ssl, link_mtu);
 
   std::shared_ptr<EC_KEY> ecdh = std::shared_ptr<EC_KEY>(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1), EC_KEY_free);
   SSL_set_options(ssl, SSL_OP_SINGLE_ECDH_USE);
@@ -123,24 +199,21 @@ bool DTLSWrapper::Initialize() {
 }
 
 void DTLSWrapper::Start() {
-  if (peer_connection->role == peer_connection->Server) {
-    SSL_set_accept_state(ssl); // This is for role server.
-  } else {
-    SSL_set_connect_state(ssl);
-  }
-  uint8_t buf[4192];
-  SSL_do_handshake(ssl);
-  while (BIO_ctrl_pending(out_bio) > 0) {
-    // XXX: This is not actually valid (buf + offset send after)
-    int nbytes = BIO_read(out_bio, buf, sizeof(buf));
-    if (nbytes > 0) {
-      this->encrypted_callback(std::make_shared<Chunk>(buf, nbytes));
+  {
+    std::lock_guard<std::mutex> lock(this->ssl_mutex);
+    if (peer_connection->role == peer_connection->Server) {
+      SSL_set_accept_state(ssl); // This is for role server.
+    } else {
+      SSL_set_connect_state(ssl);
     }
+    handshake_start = std::chrono::steady_clock::now();
   }
 
   // std::cerr << "DTLS: handshake started, start encrypt/decrypt threads" << std::endl;
   this->encrypt_thread = std::thread(&DTLSWrapper::RunEncrypt, this);
   this->decrypt_thread = std::thread(&DTLSWrapper::RunDecrypt, this);
+
+  HandshakePool::Instance().Admit(this, std::bind(&DTLSWrapper::BeginHandshake, this));
 }
 
 void DTLSWrapper::Stop() {
@@ -155,67 +228,296 @@ void DTLSWrapper::Stop() {
   if (this->decrypt_thread.joinable()) {
     this->decrypt_thread.join();
   }
+
+  // Only the decrypt thread posts handshake work, so nothing can be queued for us after this
+  HandshakePool::Instance().Cancel(this);
+}
+
+// Runs on the HandshakePool once our handshake has been admitted
+void DTLSWrapper::BeginHandshake() {
+  {
+    // The first flight is passed to encrypted_callback from within SSL_do_handshake
+    std::lock_guard<std::mutex> lock(this->ssl_mutex);
+    SSL_do_handshake(ssl);
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->handshake_mutex);
+    handshake_admitted = true;
+    handshake_drain_scheduled = true;
+  }
+  RunHandshake();
+}
+
+// Runs on the HandshakePool, feeds queued datagrams to OpenSSL until the inbox is empty or the handshake is over
+void DTLSWrapper::RunHandshake() {
+  std::vector<ChunkPtr> decrypted;
+  bool finished = false;
+  bool failed = false;
+
+  auto read_datagram = [&](ChunkPtr chunk) {
+    // Any handshake response is passed to encrypted_callback from within SSL_read
+    if (ReadRecords(chunk, decrypted) == SSL_ERROR_SSL) {
+      failed = !SSL_is_init_finished(ssl);
+    }
+  };
+
+  {
+    std::lock_guard<std::mutex> ssl_lock(this->ssl_mutex);
+    while (!finished && !failed) {
+      ChunkPtr chunk;
+      {
+        std::lock_guard<std::mutex> lock(this->handshake_mutex);
+        if (handshake_inbox.empty()) {
+          handshake_drain_scheduled = false;
+          break;
+        }
+        chunk = handshake_inbox.front();
+        handshake_inbox.pop_front();
+      }
+
+      read_datagram(chunk);
+
+      if (SSL_is_init_finished(ssl)) {
+        finished = true;
+        handshake_duration_ms =
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - handshake_start).count();
+        cipher_suite = SSL_CIPHER_get_name(SSL_get_current_cipher(ssl));
+        protocol_version = SSL_get_version(ssl);
+
+        // Whatever arrived behind the final flight is application data. It is read while we still hold
+        // ssl_mutex, so the decrypt thread cannot overtake it.
+        std::lock_guard<std::mutex> lock(this->handshake_mutex);
+        handshake_complete = true;
+        handshake_drain_scheduled = false;
+        for (auto &pending : handshake_inbox) {
+          read_datagram(pending);
+        }
+        handshake_inbox.clear();
+        handshake_records.swap(decrypted);
+        handshake_result_pending = true;
+      }
+    }
+
+    if (failed) {
+      std::lock_guard<std::mutex> lock(this->handshake_mutex);
+      handshake_drain_scheduled = false;
+      handshake_inbox.clear();
+      if (!handshake_failed) {
+        handshake_failed = true;
+        handshake_result_pending = true;
+      }
+    }
+  }
+
+  if (finished || failed) {
+    HandshakePool::Instance().Release(this);
+    // The outcome is reported from the decrypt thread, keeping the shared pool free of SCTP work
+    this->decrypt_queue.push(handshake_wakeup);
+  }
+}
+
+void DTLSWrapper::FinishHandshake() {
+  if (!handshake_result_pending) {
+    return;
+  }
+
+  std::vector<ChunkPtr> records;
+  bool failed;
+  {
+    std::lock_guard<std::mutex> lock(this->handshake_mutex);
+    if (!handshake_result_pending) {
+      return;
+    }
+    handshake_result_pending = false;
+    records.swap(handshake_records);
+    failed = handshake_failed;
+  }
+
+  if (failed) {
+    // std::cerr << "DTLS: handshake failed" << std::endl;
+    peer_connection->OnDTLSHandshakeFailed();
+    return;
+  }
+
+  if (!records.empty()) {
+    this->decrypted_callback(records);
+  }
+  // std::cerr << "DTLS: handshake is done" << std::endl;
+  peer_connection->OnDTLSHandshakeDone();
+}
+
+void DTLSWrapper::SetLinkMtu(uint16_t mtu) {
+  std::lock_guard<std::mutex> lock(this->ssl_mutex);
+  link_mtu = mtu;
+  DTLS_set_link_mtu(ssl, mtu);
+}
+
+uint16_t DTLSWrapper::GetRecordOverhead() {
+  std::lock_guard<std::mutex> lock(this->ssl_mutex);
+  size_t data_mtu = DTLS_get_data_mtu(ssl);
+  if (data_mtu == 0 || data_mtu >= link_mtu) {
+    // No cipher yet, assume the worst case of a CBC suite with a SHA-384 MAC
+    return DTLS_MAX_RECORD_OVERHEAD;
+  }
+  return (uint16_t)(link_mtu - data_mtu);
 }
 
 void DTLSWrapper::SetEncryptedCallback(std::function<void(ChunkPtr chunk)> encrypted_callback) { this->encrypted_callback = encrypted_callback; }
 
-void DTLSWrapper::SetDecryptedCallback(std::function<void(ChunkPtr chunk)> decrypted_callback) { this->decrypted_callback = decrypted_callback; }
+void DTLSWrapper::SetDecryptedCallback(std::function<void(const std::vector<ChunkPtr> &records)> decrypted_callback) { this->decrypted_callback = decrypted_callback; }
+
+RTCDtlsStats DTLSWrapper::GetStats() const {
+  RTCDtlsStats stats;
+  const char *suite = cipher_suite;
+  const char *version = protocol_version;
+  if (suite) {
+    stats.cipher_suite = suite;
+  }
+  if (version) {
+    stats.protocol_version = version;
+  }
+  stats.aes_hardware = HasAesHardware();
+  stats.handshake_duration = std::chrono::milliseconds(handshake_duration_ms.load());
+  stats.handshake_retransmits = handshake_retransmits;
+  stats.handshake_failed = handshake_failed;
+  return stats;
+}
+
+unsigned int DTLSWrapper::_OnDTLSTimer(SSL *ssl, unsigned int previous_us) {
+  DTLSWrapper *dtls = static_cast<DTLSWrapper *>(SSL_get_app_data(ssl));
+  const RTCDtlsConfiguration &config = dtls->peer_connection->TransportConfig().dtls;
+  unsigned int initial_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(config.retransmit_initial_timeout).count();
+  unsigned int max_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(config.retransmit_max_timeout).count();
+
+  // previous_us is 0 when a new flight is sent
+  if (previous_us == 0) {
+    return initial_us;
+  }
+  if (previous_us >= max_us / 2) {
+    return max_us;
+  }
+  return previous_us * 2;
+}
+
+bool DTLSWrapper::GetRetransmitTimeout(std::chrono::microseconds &timeout) {
+  struct timeval tv;
+  if (handshake_complete || handshake_failed || DTLSv1_get_timeout(ssl, &tv) != 1) {
+    return false;
+  }
+  timeout = std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+  return true;
+}
+
+void DTLSWrapper::HandleRetransmitTimeout() {
+  std::lock_guard<std::mutex> lock(this->ssl_mutex);
+  // The resent flight is passed to encrypted_callback from within DTLSv1_handle_timeout
+  int result = DTLSv1_handle_timeout(ssl);
+  if (result > 0) {
+    handshake_retransmits++;
+  } else if (result < 0) {
+    // Too many timeouts, the handshake has failed
+    {
+      std::lock_guard<std::mutex> handshake_lock(this->handshake_mutex);
+      handshake_inbox.clear();
+      if (!handshake_failed) {
+        handshake_failed = true;
+        handshake_result_pending = true;
+      }
+    }
+    HandshakePool::Instance().Release(this);
+  }
+}
 
 void DTLSWrapper::DecryptData(ChunkPtr chunk) { this->decrypt_queue.push(chunk); }
 
+void DTLSWrapper::DecryptBatch(const std::vector<ChunkPtr> &chunks) { this->decrypt_queue.push_all(chunks); }
+
 void DTLSWrapper::RunDecrypt() {
-  bool should_notify = false;
-  while (!should_stop) {
-    int read_bytes = 0;
-    uint8_t buf[2048] = {0};
-    ChunkPtr chunk = this->decrypt_queue.wait_and_pop();
-    if (!chunk) {
-      return;
-    }
-    size_t cur_len = chunk->Length();
+  std::vector<ChunkPtr> datagrams;
+  std::vector<ChunkPtr> records;
 
+  while (!should_stop) {
+    // While a handshake flight is outstanding, wake up in time to resend it
+    std::chrono::microseconds retransmit_timeout;
+    bool retransmit_pending;
     {
       std::lock_guard<std::mutex> lock(this->ssl_mutex);
+      retransmit_pending = GetRetransmitTimeout(retransmit_timeout);
+    }
 
-      // std::cout << "DTLS: Decrypting data of size - " << chunk->Length() << std::endl;
-      BIO_write(in_bio, chunk->Data(), (int)chunk->Length());
-      read_bytes = SSL_read(ssl, buf, sizeof(buf));
+    ChunkPtr chunk = retransmit_pending ? this->decrypt_queue.wait_and_pop_for(retransmit_timeout) : this->decrypt_queue.wait_and_pop();
+    if (!chunk) {
+      if (should_stop || !retransmit_pending) {
+        return;
+      }
+      HandleRetransmitTimeout();
+      FinishHandshake();
+      continue;
+    }
 
-      if (!handshake_complete) {
-        if (BIO_ctrl_pending(out_bio)) {
-          uint8_t out_buf[2048];
-          int send_bytes = 0;
-          while (BIO_ctrl_pending(out_bio) > 0) {
-            send_bytes += BIO_read(out_bio, out_buf + send_bytes, sizeof(out_buf) - send_bytes);
-          }
-          if (send_bytes > 0) {
-            this->encrypted_callback(std::make_shared<Chunk>(out_buf, send_bytes));
+    // Take whatever else has arrived so it is decrypted under one lock and delivered as one batch
+    datagrams.clear();
+    datagrams.push_back(chunk);
+    this->decrypt_queue.pop_all(datagrams);
+    datagrams.erase(std::remove(datagrams.begin(), datagrams.end(), handshake_wakeup), datagrams.end());
+
+    if (!handshake_complete) {
+      // Handshake crypto stays off this thread, see RunHandshake
+      bool queued = false;
+      {
+        std::lock_guard<std::mutex> lock(this->handshake_mutex);
+        if (!handshake_complete) {
+          queued = true;
+          if (!handshake_failed) {
+            handshake_inbox.insert(handshake_inbox.end(), datagrams.begin(), datagrams.end());
+            if (handshake_admitted && !handshake_drain_scheduled) {
+              handshake_drain_scheduled = true;
+              HandshakePool::Instance().Post(this, std::bind(&DTLSWrapper::RunHandshake, this));
+            }
           }
         }
-
-        if (SSL_is_init_finished(ssl)) {
-          handshake_complete = true;
-          should_notify = true;
-        }
+      }
+      if (queued) {
+        FinishHandshake();
+        continue;
       }
     }
 
-    // std::cerr << "Read this many bytes " << read_bytes << std::endl;
-    if (read_bytes > 0) {
-      // std::cerr << "DTLS: Calling decrypted callback with data of size: " << read_bytes << std::endl;
-      this->decrypted_callback(std::make_shared<Chunk>(buf, read_bytes));
-    } else {
-      // TODO: SSL error checking
+    records.clear();
+    {
+      std::lock_guard<std::mutex> lock(this->ssl_mutex);
+      for (auto &datagram : datagrams) {
+        // std::cout << "DTLS: Decrypting data of size - " << datagram->Length() << std::endl;
+        ReadRecords(datagram, records);
+        // TODO: SSL error checking
+      }
     }
 
-    if (should_notify) {
-      // std::cerr << "DTLS: handshake is done" << std::endl;
-      should_notify = false;
-      peer_connection->OnDTLSHandshakeDone();
+    // The handshake may have completed while we waited for ssl_mutex, its records and outcome go first
+    FinishHandshake();
+
+    if (!records.empty()) {
+      // std::cerr << "DTLS: Calling decrypted callback with records: " << records.size() << std::endl;
+      this->decrypted_callback(records);
     }
   }
 }
 
+int DTLSWrapper::ReadRecords(ChunkPtr datagram, std::vector<ChunkPtr> &records) {
+  // With read-ahead on, OpenSSL takes the whole datagram on the first SSL_read and returns one record per call,
+  // the final call finds the BIO empty and would block.
+  uint8_t buf[SSL3_RT_MAX_PLAIN_LENGTH];
+  int read_bytes;
+
+  this->in_datagram = datagram;
+  while ((read_bytes = SSL_read(ssl, buf, sizeof(buf))) > 0) {
+    records.push_back(this->in_pool.Get(buf, read_bytes));
+  }
+  this->in_datagram.reset();
+
+  return SSL_get_error(ssl, read_bytes);
+}
+
 void DTLSWrapper::EncryptData(ChunkPtr chunk) { this->encrypt_queue.push(chunk); }
 
 void DTLSWrapper::RunEncrypt() {
@@ -228,21 +530,80 @@ void DTLSWrapper::RunEncrypt() {
     // std::cerr << "DTLS: Encrypting message of len - " << chunk->Length() << std::endl;
     {
       std::lock_guard<std::mutex> lock(this->ssl_mutex);
-      uint8_t buf[2048] = {0};
-      if (SSL_write(ssl, chunk->Data(), (int)chunk->Length()) != chunk->Length()) {
+      // The resulting record is passed to encrypted_callback from within SSL_write
+      if (SSL_write(ssl, chunk->Data(), (int)chunk->Length()) != (int)chunk->Length()) {
         // TODO: Error handling
       }
+    }
+  }
+}
 
-      int nbytes = 0;
-      while (BIO_ctrl_pending(out_bio) > 0) {
-        nbytes += BIO_read(out_bio, buf + nbytes, 2048 - nbytes);
-      }
-
-      if (nbytes > 0) {
-        // std::cerr << "DTLS: Calling the encrypted data cb" << std::endl;
-        this->encrypted_callback(std::make_shared<Chunk>(buf, nbytes));
-      }
+BIO_METHOD *DTLSWrapper::DatagramBIOMethod() {
+  static BIO_METHOD *method = []() {
+    BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "rtcdcpp datagram");
+    if (m) {
+      BIO_meth_set_read(m, &DTLSWrapper::_OnBIORead);
+      BIO_meth_set_write(m, &DTLSWrapper::_OnBIOWrite);
+      BIO_meth_set_ctrl(m, &DTLSWrapper::_OnBIOCtrl);
+      BIO_meth_set_create(m, &DTLSWrapper::_OnBIOCreate);
     }
+    return m;
+  }();
+  return method;
+}
+
+int DTLSWrapper::_OnBIOCreate(BIO *bio) {
+  BIO_set_init(bio, 1);
+  return 1;
+}
+
+int DTLSWrapper::_OnBIORead(BIO *bio, char *buf, int len) {
+  BIO_clear_retry_flags(bio);
+  DTLSWrapper *dtls = static_cast<DTLSWrapper *>(BIO_get_data(bio));
+  int nbytes = dtls ? dtls->OnBIORead(buf, len) : -1;
+  if (nbytes < 0) {
+    BIO_set_retry_read(bio);
   }
+  return nbytes;
+}
+
+int DTLSWrapper::_OnBIOWrite(BIO *bio, const char *buf, int len) {
+  BIO_clear_retry_flags(bio);
+  DTLSWrapper *dtls = static_cast<DTLSWrapper *>(BIO_get_data(bio));
+  return dtls ? dtls->OnBIOWrite(buf, len) : -1;
+}
+
+long DTLSWrapper::_OnBIOCtrl(BIO *bio, int cmd, long /*num*/, void * /*ptr*/) {
+  DTLSWrapper *dtls = static_cast<DTLSWrapper *>(BIO_get_data(bio));
+  switch (cmd) {
+    case BIO_CTRL_FLUSH:
+      return 1;
+    case BIO_CTRL_PENDING:
+      return (dtls && dtls->in_datagram) ? (long)dtls->in_datagram->Length() : 0;
+    case BIO_CTRL_WPENDING:
+      return 0;
+    case BIO_CTRL_DGRAM_GET_MTU_OVERHEAD:
+      // The link MTU we give OpenSSL is already the datagram payload size
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+// Called with ssl_mutex held. Hands out the whole inbound datagram at once, like a UDP socket would.
+int DTLSWrapper::OnBIORead(char *buf, int len) {
+  if (!in_datagram) {
+    return -1;
+  }
+  int nbytes = std::min(len, (int)in_datagram->Length());
+  memcpy(buf, in_datagram->Data(), nbytes);
+  in_datagram.reset();
+  return nbytes;
+}
+
+// Called with ssl_mutex held. OpenSSL writes exactly one datagram per call.
+int DTLSWrapper::OnBIOWrite(const char *buf, int len) {
+  this->encrypted_callback(out_pool.Get(buf, len));
+  return len;
 }
 }
@@ -39,8 +39,9 @@
 
 namespace rtcdcpp {
 
-DataChannel::DataChannel(PeerConnection *pc, uint16_t stream_id, uint8_t chan_type, std::string label, std::string protocol, uint32_t reliability)
-    : pc(pc), stream_id(stream_id), chan_type(chan_type), label(label), protocol(protocol), reliability(reliability) {
+DataChannel::DataChannel(PeerConnection *pc, uint16_t stream_id, uint8_t chan_type, std::string label, std::string protocol, uint32_t reliability,
+                         uint16_t priority)
+    : pc(pc), stream_id(stream_id), chan_type(chan_type), label(label), protocol(protocol), reliability(reliability), priority(priority) {
   // XXX: Default-noop callbacks
   open_cb = []() { ; };  // XXX: I love and hate that this is valid c++
   str_msg_cb = [](std::string x) { ; };
@@ -57,6 +58,8 @@ uint16_t DataChannel::GetStreamID() { return this->stream_id; }
 
 uint8_t DataChannel::GetChannelType() { return this->chan_type; }
 
+uint16_t DataChannel::GetPriority() { return this->priority; }
+
 std::string DataChannel::GetLabel() { return this->label; }
 
 std::string DataChannel::GetProtocol() { return this->protocol; }
@@ -82,17 +85,26 @@ bool DataChannel::SendBinary(const uint8_t *msg, int len) {
   return true;
 }
 
+bool DataChannel::SendBinaryFragment(const uint8_t *msg, int len, bool is_last) {
+  this->pc->SendBinaryFragment(msg, len, this->stream_id, is_last);
+  return true;
+}
+
 void DataChannel::StopSendData()
 {
     pc->StopSendData();
 }
 
+void DataChannel::SetBundled(bool bundled) { this->bundled = bundled; }
+
 void DataChannel::SetOnOpen(std::function<void()> open_cb) { this->open_cb = open_cb; }
 
 void DataChannel::SetOnStringMsgCallback(std::function<void(std::string msg)> str_msg_cb) { this->str_msg_cb = str_msg_cb; }
 
 void DataChannel::SetOnBinaryMsgCallback(std::function<void(ChunkPtr)> bin_msg_cb) { this->bin_msg_cb = bin_msg_cb; }
 
+void DataChannel::SetOnFragmentCallback(std::function<void(ChunkPtr fragment, bool is_last)> fragment_cb) { this->fragment_cb = fragment_cb; }
+
 void DataChannel::SetOnClosedCallback(std::function<void()> closed_cb) { this->closed_cb = closed_cb; }
 
 void DataChannel::SetOnErrorCallback(std::function<void(std::string description)> error_cb) { this->error_cb = error_cb; }
@@ -115,6 +127,12 @@ void DataChannel::OnBinaryMsg(ChunkPtr msg) {
   }
 }
 
+void DataChannel::OnFragment(ChunkPtr fragment, bool is_last) {
+  if (this->fragment_cb) {
+    this->fragment_cb(fragment, is_last);
+  }
+}
+
 void DataChannel::OnClosed() {
   if (this->closed_cb) {
     this->closed_cb();
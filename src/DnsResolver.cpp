@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * Asynchronous, cached hostname resolution for ICE servers.
+ */
+
+#include <algorithm>
+#include <cstring>
+#ifndef __WIN32
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif // __WIN32
+
+#include "DnsResolver.hpp"
+
+namespace rtcdcpp {
+
+static bool IsNumericAddress(const std::string &hostname) {
+  unsigned char buf[sizeof(struct in6_addr)];
+  return inet_pton(AF_INET, hostname.c_str(), buf) == 1 || inet_pton(AF_INET6, hostname.c_str(), buf) == 1;
+}
+
+DnsResolver &DnsResolver::Instance() {
+  static DnsResolver resolver;
+  return resolver;
+}
+
+DnsResolver::DnsResolver() : ttl(300), negative_ttl(30) {}
+
+DnsResolver::~DnsResolver() {
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stopping = true;
+    work_cond.notify_all();
+  }
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+void DnsResolver::Configure(std::chrono::seconds new_ttl, std::chrono::seconds new_negative_ttl) {
+  std::lock_guard<std::mutex> lock(mut);
+  ttl = new_ttl;
+  negative_ttl = new_negative_ttl;
+}
+
+void DnsResolver::Resolve(const std::string &hostname, const void *owner,
+                          std::function<void(const std::vector<std::string> &addresses)> on_resolved) {
+  if (IsNumericAddress(hostname)) {
+    on_resolved(std::vector<std::string>{hostname});
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mut);
+  Entry &entry = cache[hostname];
+  if (!entry.resolving && std::chrono::steady_clock::now() < entry.expires) {
+    std::vector<std::string> addresses = entry.addresses;
+    lock.unlock();
+    on_resolved(addresses);
+    return;
+  }
+
+  entry.waiters.push_back(Waiter{owner, std::move(on_resolved)});
+  if (!entry.resolving) {
+    entry.resolving = true;
+    lookups.push_back(hostname);
+    if (!worker.joinable()) {
+      worker = std::thread(&DnsResolver::RunWorker, this);
+    }
+    work_cond.notify_one();
+  }
+}
+
+void DnsResolver::Cancel(const void *owner) {
+  std::unique_lock<std::mutex> lock(mut);
+  auto owned_by = [owner](const Waiter &waiter) { return waiter.owner == owner; };
+  for (auto &cached : cache) {
+    auto &waiters = cached.second.waiters;
+    waiters.erase(std::remove_if(waiters.begin(), waiters.end(), owned_by), waiters.end());
+  }
+
+  while (running.count(owner) > 0) {
+    idle_cond.wait(lock);
+  }
+}
+
+std::vector<std::string> DnsResolver::Lookup(const std::string &hostname) {
+  std::vector<std::string> addresses;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *result = nullptr;
+  if (getaddrinfo(hostname.c_str(), nullptr, &hints, &result) != 0) {
+    //std::cerr << "Failed to lookup host for server: " << hostname << '\n';
+    return addresses;
+  }
+
+  for (struct addrinfo *info = result; info != nullptr; info = info->ai_next) {
+    char host[NI_MAXHOST];
+    if (getnameinfo(info->ai_addr, info->ai_addrlen, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) == 0 &&
+        std::find(addresses.begin(), addresses.end(), host) == addresses.end()) {
+      addresses.push_back(host);
+    }
+  }
+  freeaddrinfo(result);
+  return addresses;
+}
+
+void DnsResolver::RunWorker() {
+  std::unique_lock<std::mutex> lock(mut);
+  while (true) {
+    while (!stopping && lookups.empty()) {
+      work_cond.wait(lock);
+    }
+    if (stopping) {
+      return;
+    }
+
+    std::string hostname = std::move(lookups.front());
+    lookups.pop_front();
+
+    lock.unlock();
+    std::vector<std::string> addresses = Lookup(hostname);
+    lock.lock();
+
+    Entry &entry = cache[hostname];
+    entry.addresses = addresses;
+    entry.expires = std::chrono::steady_clock::now() + (addresses.empty() ? negative_ttl : ttl);
+    entry.resolving = false;
+
+    // Take waiters one at a time, so Cancel() can still remove those not yet called
+    while (!entry.waiters.empty()) {
+      Waiter waiter = std::move(entry.waiters.front());
+      entry.waiters.erase(entry.waiters.begin());
+      auto running_it = running.insert(waiter.owner);
+      lock.unlock();
+      waiter.fn(addresses);
+      lock.lock();
+      running.erase(running_it);
+      idle_cond.notify_all();
+    }
+  }
+}
+}
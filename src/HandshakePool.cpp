@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * Bounded worker pool for DTLS handshakes.
+ */
+
+#include <algorithm>
+
+#include "HandshakePool.hpp"
+
+namespace rtcdcpp {
+
+HandshakePool &HandshakePool::Instance() {
+  static HandshakePool pool;
+  return pool;
+}
+
+HandshakePool::HandshakePool() : max_active(64) {
+  Configure(std::max(1u, std::thread::hardware_concurrency() / 4), max_active);
+}
+
+HandshakePool::~HandshakePool() {
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stopping = true;
+    work_cond.notify_all();
+  }
+  for (auto &worker : workers) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+}
+
+void HandshakePool::Configure(size_t num_workers, size_t new_max_active) {
+  std::lock_guard<std::mutex> lock(mut);
+  max_active = std::max<size_t>(1, new_max_active);
+  while (workers.size() < num_workers) {
+    workers.emplace_back(&HandshakePool::RunWorker, this);
+  }
+  AdmitWaiting();
+}
+
+void HandshakePool::Admit(const void *owner, std::function<void()> on_admitted) {
+  std::lock_guard<std::mutex> lock(mut);
+  waiting.push_back(Task{owner, std::move(on_admitted)});
+  AdmitWaiting();
+}
+
+void HandshakePool::Post(const void *owner, std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(mut);
+  tasks.push_back(Task{owner, std::move(task)});
+  work_cond.notify_one();
+}
+
+void HandshakePool::Release(const void *owner) {
+  std::lock_guard<std::mutex> lock(mut);
+  if (active.erase(owner) > 0) {
+    AdmitWaiting();
+  }
+}
+
+void HandshakePool::Cancel(const void *owner) {
+  std::unique_lock<std::mutex> lock(mut);
+  auto owned_by = [owner](const Task &task) { return task.owner == owner; };
+  tasks.erase(std::remove_if(tasks.begin(), tasks.end(), owned_by), tasks.end());
+  waiting.erase(std::remove_if(waiting.begin(), waiting.end(), owned_by), waiting.end());
+
+  while (running.count(owner) > 0) {
+    idle_cond.wait(lock);
+  }
+
+  if (active.erase(owner) > 0) {
+    AdmitWaiting();
+  }
+}
+
+size_t HandshakePool::ActiveHandshakes() {
+  std::lock_guard<std::mutex> lock(mut);
+  return active.size();
+}
+
+size_t HandshakePool::QueuedHandshakes() {
+  std::lock_guard<std::mutex> lock(mut);
+  return waiting.size();
+}
+
+void HandshakePool::AdmitWaiting() {
+  while (!waiting.empty() && active.size() < max_active) {
+    Task task = std::move(waiting.front());
+    waiting.pop_front();
+    active.insert(task.owner);
+    tasks.push_back(std::move(task));
+    work_cond.notify_one();
+  }
+}
+
+void HandshakePool::RunWorker() {
+  std::unique_lock<std::mutex> lock(mut);
+  while (true) {
+    while (!stopping && tasks.empty()) {
+      work_cond.wait(lock);
+    }
+    if (stopping) {
+      return;
+    }
+
+    Task task = std::move(tasks.front());
+    tasks.pop_front();
+    auto running_it = running.insert(task.owner);
+
+    lock.unlock();
+    task.fn();
+    lock.lock();
+
+    running.erase(running_it);
+    idle_cond.notify_all();
+  }
+}
+}
@@ -28,6 +28,8 @@
 /**
  * Basic implementation of libnice stuff.
  */
+#include <algorithm>
+#include <cerrno>
 #include <sstream>
 #ifndef __WIN32
 #include <netdb.h>
@@ -35,6 +37,7 @@
 #include <winsock2.h>
 #endif // __WIN32
 
+#include "DnsResolver.hpp"
 #include "NiceWrapper.hpp"
 
  void ReplaceAll(std::string &s, const std::string &search, const std::string &replace) {
@@ -45,25 +48,20 @@
    }
  }
 
- const char* GetIpByHostname(const char *hostname)
- {
-     struct hostent *stun_host = gethostbyname(hostname);
-     if (stun_host == nullptr) {
-         //std::cerr << "Failed to lookup host for server: " << hostname << '\n';
-         return nullptr;
-     } else {
-         in_addr *address = (in_addr *)stun_host->h_addr;
-         return inet_ntoa(*address);
-     }
- }
-
  namespace rtcdcpp {
 
  using namespace std;
 
+ // One byte more than the largest datagram we expect, so a datagram that fills the buffer was cut short
+ static size_t RecvBufferSize(const RTCTransportConfiguration &config) {
+   return std::max({(size_t)NICE_RECV_BUFFER_SIZE, (size_t)config.path_mtu, (size_t)config.max_path_mtu}) + 1;
+ }
+
  NiceWrapper::NiceWrapper(PeerConnection *peer_connection)
-     : peer_connection(peer_connection), stream_id(0), should_stop(false), send_queue(), agent(NULL, nullptr), loop(NULL, nullptr), context(NULL, nullptr), packets_sent(0) {
+     : peer_connection(peer_connection), stream_id(0), should_stop(false), send_queue(), agent(NULL, nullptr), loop(NULL, nullptr), context(NULL, nullptr), packets_sent(0),
+       recv_cancellable(NULL, nullptr), recv_pool(RecvBufferSize(peer_connection->TransportConfig()), 2 * peer_connection->TransportConfig().receive_batch_size) {
    data_received_callback = [](ChunkPtr x) { ; };
+   batch_received_callback = [](const std::vector<ChunkPtr> &x) { ; };
    nice_debug_disable(true);
  }
 
@@ -146,6 +144,15 @@
  void NiceWrapper::LogMessage(const gchar *message) {}
 
  bool NiceWrapper::Initialize() {
+#ifndef __WIN32
+   this->mux = peer_connection->TransportConfig().udp_mux;
+   if (this->mux) {
+     // ICE-lite on the shared sockets, without an agent or main loop of our own
+     this->mux_peer = this->mux->Register([this]() { OnIceReady(); }, [this](ChunkPtr chunk) { this->data_received_callback(chunk); });
+     return true;
+   }
+#endif // __WIN32
+
    int log_flags = G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL | G_LOG_FLAG_RECURSION;
    g_log_set_handler(NULL, (GLogLevelFlags)log_flags, nice_log_handler, this);
 
@@ -161,7 +168,9 @@
     return false;
    }
 
-   this->agent = std::unique_ptr<NiceAgent, decltype(&g_object_unref)>(nice_agent_new(g_main_loop_get_context(loop.get()), NICE_COMPATIBILITY_RFC5245),
+   // An ICE-lite agent only answers connectivity checks on its host candidates, it never sends any
+   NiceAgentOption agent_options = peer_connection->TransportConfig().ice_lite ? NICE_AGENT_OPTION_LITE_MODE : (NiceAgentOption)0;
+   this->agent = std::unique_ptr<NiceAgent, decltype(&g_object_unref)>(nice_agent_new_full(g_main_loop_get_context(loop.get()), NICE_COMPATIBILITY_RFC5245, agent_options),
                                                                        g_object_unref);
    if (!this->agent) {
 //     std::cerr << "Failed to initialize nice agent\n";
@@ -181,7 +190,15 @@
 
    nice_agent_set_stream_name(agent.get(), this->stream_id, "application");
 
+   const bool ice_lite = peer_connection->TransportConfig().ice_lite;
    for(const auto &conf : peer_connection->Config()) {
+       if(ice_lite) {
+           // Lite agents only have host candidates, STUN and TURN servers are of no use
+           if(IceServerType::STUN == conf.type && !conf.ice_ufrag.empty() && !conf.ice_pwd.empty()) {
+               nice_agent_set_local_credentials(agent.get(), this->stream_id, conf.ice_ufrag.c_str(), conf.ice_pwd.c_str());
+           }
+           continue;
+       }
        if(IceServerType::STUN == conf.type) {
            AddStunServers(conf);
        }
@@ -198,29 +215,38 @@
    g_signal_connect(G_OBJECT(agent.get()), "new-candidate-full", G_CALLBACK(new_local_candidate), this);
    g_signal_connect(G_OBJECT(agent.get()), "new-selected-pair", G_CALLBACK(new_selected_pair), this);
 
-   if(!nice_agent_attach_recv(agent.get(), this->stream_id, 1, g_main_loop_get_context(loop.get()), data_received, this)) {
+   if (peer_connection->TransportConfig().receive_batch_size > 0) {
+     // nice_agent_recv_messages must not be combined with an attached receive callback
+     this->recv_cancellable = std::unique_ptr<GCancellable, void (*)(gpointer)>(g_cancellable_new(), g_object_unref);
+   } else if(!nice_agent_attach_recv(agent.get(), this->stream_id, 1, g_main_loop_get_context(loop.get()), data_received, this)) {
        return false;
    }
 
+   // Gather while the offer/answer exchange is in flight, candidates trickle out as they are found
+   if (peer_connection->TransportConfig().gather_on_initialize && !GatherCandidates()) {
+     return false;
+   }
+
    return true;
  }
 
  void NiceWrapper::AddStunServers(const RTCConfiguration &config)
  {
-     if (config.ice_servers.size() > 1) {
-       throw std::invalid_argument("Only up to one ICE server is currently supported\n");
-     }
-
+     // libnice queries a single STUN server. The first one to resolve is used and the others are ignored,
+     // there is no fallback if it does not answer.
      for (const auto &ice_server : config.ice_servers) {
-         const char *ipAddr = GetIpByHostname(ice_server.hostname_.c_str());
-         if(nullptr != ipAddr) {
-             g_object_set(G_OBJECT(agent.get()), "stun-server", ipAddr, NULL);
-         }
-         if (ice_server.port_ > 0) {
-             g_object_set(G_OBJECT(agent.get()), "stun-server-port", ice_server.port_, NULL);
-         } else {
+         if (ice_server.port_ <= 0) {
              //std::cerr << "stun port empty\n";
+             continue;
          }
+         int port = ice_server.port_;
+         ResolveServer(ice_server.hostname_, [this, port](const std::string &address) {
+             if (!stun_server_set) {
+                 stun_server_set = true;
+                 g_object_set(G_OBJECT(agent.get()), "stun-server", address.c_str(), NULL);
+                 g_object_set(G_OBJECT(agent.get()), "stun-server-port", port, NULL);
+             }
+         });
      }
 
      if (!config.ice_ufrag.empty() && !config.ice_pwd.empty()) {
@@ -228,39 +254,146 @@
      }
  }
 
+ static NiceRelayType RelayType(IceTransport transport) {
+   switch (transport) {
+     case IceTransport::TCP:
+       return NICE_RELAY_TYPE_TURN_TCP;
+     case IceTransport::TLS:
+       return NICE_RELAY_TYPE_TURN_TLS;
+     case IceTransport::UDP:
+     default:
+       return NICE_RELAY_TYPE_TURN_UDP;
+   }
+ }
+
+ // Every TURN server becomes a relay, libnice allocates on all of them in parallel
  void NiceWrapper::AddTurnServers(const RTCConfiguration &config)
  {
     for(const auto &turnServ : config.ice_servers) {
-        const char *ipAddr = GetIpByHostname(turnServ.hostname_.c_str());
-        if(nullptr != ipAddr
-           && 0 < turnServ.port_
+        if(0 < turnServ.port_
            && !config.ice_ufrag.empty()
            && !config.ice_pwd.empty() )
         {
-            nice_agent_set_relay_info(this->agent.get()
-                                      , this->stream_id
-                                      , 1
-                                      , ipAddr
-                                      , turnServ.port_
-                                      , config.ice_ufrag.c_str()
-                                      , config.ice_pwd.c_str()
-                                      , NICE_RELAY_TYPE_TURN_UDP
-                                      );
+            int port = turnServ.port_;
+            NiceRelayType relay_type = RelayType(turnServ.transport_);
+            std::string username = config.ice_ufrag;
+            std::string password = config.ice_pwd;
+            ResolveServer(turnServ.hostname_, [this, port, relay_type, username, password](const std::string &address) {
+                nice_agent_set_relay_info(this->agent.get()
+                                          , this->stream_id
+                                          , 1
+                                          , address.c_str()
+                                          , port
+                                          , username.c_str()
+                                          , password.c_str()
+                                          , relay_type
+                                          );
+            });
         }
     }
  }
 
+ // Servers only take part in gathering if they resolve before it starts, see GatherCandidates
+ void NiceWrapper::ResolveServer(const std::string &hostname, std::function<void(const std::string &address)> on_resolved) {
+   {
+     std::lock_guard<std::mutex> lock(resolve_mutex);
+     pending_resolutions++;
+   }
+   DnsResolver::Instance().Resolve(hostname, this, [this, on_resolved](const std::vector<std::string> &addresses) {
+     bool gather;
+     {
+       std::lock_guard<std::mutex> lock(resolve_mutex);
+       if (addresses.empty()) {
+         //std::cerr << "Failed to lookup host for server\n";
+       } else if (!gathering_started) {
+         on_resolved(addresses.front());
+       }
+       gather = --pending_resolutions == 0 && gather_requested;
+     }
+     if (gather) {
+       StartGathering();
+     }
+   });
+ }
+
+ gboolean resolve_timeout_expired(gpointer user_data) {
+   NiceWrapper *nice = (NiceWrapper *)user_data;
+   nice->StartGathering();
+   return FALSE;
+ }
+
+ bool NiceWrapper::GatherCandidates() {
+   {
+     std::lock_guard<std::mutex> lock(resolve_mutex);
+     if (pending_resolutions > 0) {
+       // Wait for the servers, but not for long on any slow one
+       gather_requested = true;
+       if (!this->resolve_timeout) {
+         this->resolve_timeout = g_timeout_source_new(NICE_RESOLVE_TIMEOUT_MS);
+         g_source_set_callback(this->resolve_timeout, resolve_timeout_expired, this, NULL);
+         g_source_attach(this->resolve_timeout, g_main_loop_get_context(loop.get()));
+       }
+       return true;
+     }
+   }
+   return StartGathering();
+ }
+
+ bool NiceWrapper::StartGathering() {
+   {
+     std::lock_guard<std::mutex> lock(resolve_mutex);
+     if (gathering_started) {
+       return true;
+     }
+     gathering_started = true;
+   }
+   if (!nice_agent_gather_candidates(agent.get(), this->stream_id)) {
+     //std::cerr << "Error gathering candidates\n";
+     return false;
+   }
+   return true;
+ }
+
  void NiceWrapper::StartSendLoop() { this->send_thread = std::thread(&NiceWrapper::SendLoop, this); }
 
+ void NiceWrapper::StartRecvLoop() {
+   if (this->recv_cancellable) {
+     this->recv_thread = std::thread(&NiceWrapper::RecvLoop, this);
+   }
+ }
+
  void NiceWrapper::Stop() {
    this->should_stop = true;
 
+   // No resolver callback may touch the agent from here on
+   DnsResolver::Instance().Cancel(this);
+   if (this->resolve_timeout) {
+     g_source_destroy(this->resolve_timeout);
+     g_source_unref(this->resolve_timeout);
+     this->resolve_timeout = nullptr;
+   }
+
    send_queue.Stop();
    if (this->send_thread.joinable()) {
      this->send_thread.join();
    }
 
-   g_main_loop_quit(this->loop.get());
+   if (this->recv_cancellable) {
+     g_cancellable_cancel(this->recv_cancellable.get());
+   }
+   if (this->recv_thread.joinable()) {
+     this->recv_thread.join();
+   }
+
+#ifndef __WIN32
+   if (this->mux_peer) {
+     this->mux->Unregister(this->mux_peer);
+   }
+#endif // __WIN32
+
+   if (this->loop) {
+     g_main_loop_quit(this->loop.get());
+   }
 
    if (this->g_main_loop_thread.joinable()) {
      this->g_main_loop_thread.join();
@@ -268,6 +401,11 @@
  }
 
  void NiceWrapper::ParseRemoteSDP(std::string remote_sdp) {
+   if (this->mux) {
+     // Checks are answered with our own credentials, the remote's are not needed
+     return;
+   }
+
    string crfree_remote_sdp = remote_sdp;
 
    // TODO: Improve this. This is needed because otherwise libnice will wrongly take the '\r' as part of ice-ufrag/password.
@@ -279,13 +417,14 @@
      throw std::runtime_error("ParseRemoteSDP: " + std::string(strerror(rc)));
    }
 
-   if (!nice_agent_gather_candidates(agent.get(), this->stream_id)) {
+   // A no-op if gathering already started in Initialize
+   if (!GatherCandidates()) {
      throw std::runtime_error("ParseRemoteSDP: Error gathering candidates!");
    }
  }
 
  void NiceWrapper::SendData(ChunkPtr chunk) {
-   if (this->stream_id == 0) {
+   if (this->stream_id == 0 && !this->mux) {
     //std::cerr << "ICE: ERROR sending data to unitialized nice context\n";
      return;
    }
@@ -293,20 +432,122 @@
    this->send_queue.push(chunk);
  }
 
- // Pull items off the send queue and call nice_agent_send
+ // Pull everything off the send queue and hand it to libnice in batches, one datagram per chunk
  void NiceWrapper::SendLoop() {
+   // Datagrams not sent yet start at pending[first]
+   std::vector<ChunkPtr> pending;
+   size_t first = 0;
+   GOutputVector vectors[NICE_SEND_BATCH_SIZE];
+   NiceOutputMessage messages[NICE_SEND_BATCH_SIZE];
+
    while (!this->should_stop) {
-     ChunkPtr chunk = send_queue.wait_and_pop();
-     if (!chunk) {
-       return;
+     if (first == pending.size()) {
+       pending.clear();
+       first = 0;
+       ChunkPtr chunk = send_queue.wait_and_pop();
+       if (!chunk) {
+         return;
+       }
+       pending.push_back(chunk);
+     }
+     send_queue.pop_all(pending);
+
+     guint count = (guint)std::min(pending.size() - first, (size_t)NICE_SEND_BATCH_SIZE);
+     gint sent;
+     bool would_block;
+#ifndef __WIN32
+     if (this->mux) {
+       sent = this->mux->Send(*this->mux_peer, &pending[first], count);
+       would_block = sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN);
+     } else
+#endif // __WIN32
+     {
+       for (guint i = 0; i < count; i++) {
+         vectors[i].buffer = pending[first + i]->Data();
+         vectors[i].size = pending[first + i]->Length();
+         messages[i].buffers = &vectors[i];
+         messages[i].n_buffers = 1;
+       }
+
+       GError *error = NULL;
+       sent = nice_agent_send_messages_nonblocking(this->agent.get(), this->stream_id, 1, messages, count, NULL, &error);
+       would_block = sent < 0 && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+       g_clear_error(&error);
      }
-     size_t cur_len = chunk->Length();
-     int result = 0;
-     result = nice_agent_send(this->agent.get(), this->stream_id, 1, (guint)cur_len, (const char *)chunk->Data());
-     if (result != cur_len) {
-      //std::cerr << "ICE: Failed to send data\n";
+     if (sent < 0) {
+       if (would_block) {
+         // Socket buffer full, keep the datagrams and try again shortly
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+       } else {
+        //std::cerr << "ICE: Failed to send data\n";
+         // Only the first datagram is known to be bad, e.g. too big, the rest get their own attempt
+         first += 1;
+       }
      } else {
-       // std::cerr << "ICE: Data sent " << cur_len << std::endl;
+       first += sent;
+       if ((guint)sent < count) {
+         // Only part of the batch fit, the tail goes out with the next batch
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+       }
+     }
+   }
+ }
+
+ // Block for one datagram, then take whatever else is already waiting without blocking
+ void NiceWrapper::RecvLoop() {
+   const size_t batch_size = peer_connection->TransportConfig().receive_batch_size;
+   const size_t buffer_size = RecvBufferSize(peer_connection->TransportConfig());
+   std::vector<ChunkPtr> buffers(batch_size);
+   std::vector<GInputVector> vectors(batch_size);
+   std::vector<NiceInputMessage> messages(batch_size);
+   std::vector<ChunkPtr> received;
+   unsigned int backoff_ms = 1;
+
+   while (!this->should_stop) {
+     for (size_t i = 0; i < batch_size; i++) {
+       if (!buffers[i]) {
+         buffers[i] = recv_pool.Get(buffer_size);
+       }
+       vectors[i].buffer = buffers[i]->Data();
+       vectors[i].size = buffers[i]->Capacity();
+       messages[i].buffers = &vectors[i];
+       messages[i].n_buffers = 1;
+       messages[i].from = NULL;
+       messages[i].length = 0;
+     }
+
+     GError *error = NULL;
+     gint count = nice_agent_recv_messages(this->agent.get(), this->stream_id, 1, messages.data(), 1, this->recv_cancellable.get(), &error);
+     if (count > 0 && batch_size > 1) {
+       gint more = nice_agent_recv_messages_nonblocking(this->agent.get(), this->stream_id, 1, messages.data() + 1, batch_size - 1, NULL, NULL);
+       if (more > 0) {
+         count += more;
+       }
+     }
+     if (count <= 0) {
+       bool cancelled = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+       g_clear_error(&error);
+       if (cancelled) {
+         return;
+       }
+       // Back off while the error persists instead of spinning on it
+       std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+       backoff_ms = std::min(backoff_ms * 2, (unsigned int)NICE_RECV_MAX_BACKOFF_MS);
+       continue;
+     }
+     backoff_ms = 1;
+
+     received.clear();
+     for (gint i = 0; i < count; i++) {
+       if (messages[i].length >= buffers[i]->Capacity()) {
+         // Truncated, DTLS would only fail on it. The buffer is reused.
+         continue;
+       }
+       buffers[i]->Resize(messages[i].length);
+       received.push_back(std::move(buffers[i]));
+     }
+     if (!received.empty()) {
+       this->batch_received_callback(received);
      }
    }
  }
@@ -316,6 +557,15 @@
    std::stringstream result;
    std::string line;
 
+#ifndef __WIN32
+   if (this->mux) {
+     result << "a=ice-ufrag:" << this->mux_peer->LocalUfrag() << "\r\n";
+     result << "a=ice-pwd:" << this->mux_peer->LocalPwd() << "\r\n";
+     result << "a=" << this->mux->CandidateSdp() << "\r\n";
+     return result.str();
+   }
+#endif // __WIN32
+
    gchar *raw_sdp = nice_agent_generate_local_sdp(agent.get());
    nice_sdp << raw_sdp;
 
@@ -330,6 +580,10 @@
  }
 
  bool NiceWrapper::SetRemoteIceCandidate(string candidate_sdp) {
+   if (this->mux) {
+     // ICE-lite never checks remote candidates, the remote's checks find us
+     return true;
+   }
    GSList *list = NULL;
    NiceCandidate *rcand = nice_agent_parse_remote_candidate_sdp(this->agent.get(), this->stream_id, candidate_sdp.c_str());
 
@@ -347,6 +601,9 @@
  }
 
  bool NiceWrapper::SetRemoteIceCandidates(vector<string> candidate_sdps) {
+   if (this->mux) {
+     return true;
+   }
    GSList *list = NULL;
    for (auto candidate_sdp : candidate_sdps) {
      NiceCandidate *rcand = nice_agent_parse_remote_candidate_sdp(this->agent.get(), this->stream_id, candidate_sdp.c_str());
@@ -368,4 +625,8 @@
  void NiceWrapper::SetDataReceivedCallback(std::function<void(ChunkPtr)> data_received_callback) {
    this->data_received_callback = data_received_callback;
  }
+
+ void NiceWrapper::SetBatchReceivedCallback(std::function<void(const std::vector<ChunkPtr> &)> batch_received_callback) {
+   this->batch_received_callback = batch_received_callback;
+ }
 }
@@ -44,8 +44,10 @@ namespace rtcdcpp {
 
 std::ostream &operator<<(std::ostream &os, const RTCIceServer &ice_server) { return os << ice_server.hostname_ << ":" << ice_server.port_; }
 
-PeerConnection::PeerConnection(const IceConfig &config, IceCandidateCallbackPtr icCB, DataChannelCallbackPtr dcCB)
+PeerConnection::PeerConnection(const IceConfig &config, IceCandidateCallbackPtr icCB, DataChannelCallbackPtr dcCB,
+                               const RTCTransportConfiguration &transport_config)
     : config_(config)
+    , transport_config_(transport_config)
     , ice_candidate_cb(icCB)
     , new_channel_cb(dcCB) {
   if (!Initialize()) {
@@ -65,7 +67,8 @@ bool PeerConnection::Initialize() {
   this->dtls = std::make_unique<DTLSWrapper>(this);
   this->sctp = std::make_unique<SCTPWrapper>(
       std::bind(&DTLSWrapper::EncryptData, dtls.get(), std::placeholders::_1),
-      std::bind(&PeerConnection::OnSCTPMsgReceived, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+      std::bind(&PeerConnection::OnSCTPMsgReceived, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4),
+      transport_config_.sctp);
   if (!dtls->Initialize()) {
     std::cerr << "DTLS failure\n";
     return false;
@@ -82,9 +85,12 @@ bool PeerConnection::Initialize() {
   }
 
   nice->SetDataReceivedCallback(std::bind(&DTLSWrapper::DecryptData, dtls.get(), std::placeholders::_1));
+  nice->SetBatchReceivedCallback(std::bind(&DTLSWrapper::DecryptBatch, dtls.get(), std::placeholders::_1));
   dtls->SetDecryptedCallback(std::bind(&SCTPWrapper::DTLSForSCTP, sctp.get(), std::placeholders::_1));
   dtls->SetEncryptedCallback(std::bind(&NiceWrapper::SendData, nice.get(), std::placeholders::_1));
+  sctp->SetPathMtuCallback(std::bind(&DTLSWrapper::SetLinkMtu, dtls.get(), std::placeholders::_1));
   nice->StartSendLoop();
+  nice->StartRecvLoop();
   return true;
 }
 
@@ -103,12 +109,17 @@ void PeerConnection::ParseOffer(std::string offer_sdp) {
       } else {  // actpass
         // nothing to do
       }
+    } else if (g_str_has_prefix(line.c_str(), "a=max-message-size:")) {
+      std::size_t pos = line.find(":") + 1;
+      this->remote_max_message_size = (uint32_t)strtoul(line.c_str() + pos, nullptr, 10);
     } else if (g_str_has_prefix(line.c_str(), "a=mid:")) {
       std::size_t pos = line.find(":") + 1;
       std::size_t end = line.find("\r");
+      std::lock_guard<std::mutex> lock(mid_mutex);
       this->mid = line.substr(pos, end - pos);
     }
   }
+  ReleaseEarlyCandidates();
   nice->ParseRemoteSDP(offer_sdp);
 }
 
@@ -129,6 +140,9 @@ std::string PeerConnection::GenerateOffer() {
   sdp << "o=- " << session_id << " 0 IN IP4 0.0.0.0\r\n";  // Session ID
   sdp << "s=-\r\n";
   sdp << "t=0 0\r\n";
+  if (transport_config_.ice_lite || transport_config_.udp_mux) {
+    sdp << "a=ice-lite\r\n";
+  }
   sdp << "a=ice-options:trickle\r\n";
   sdp << "m=application 54609 DTLS/SCTP 5000\r\n";  // XXX: hardcoded port
   sdp << "a=msid-semantic: WMS\r\n";
@@ -136,13 +150,16 @@ std::string PeerConnection::GenerateOffer() {
   //  sdp << "a=mid:data\r\n";
   sdp << "a=sendrecv\r\n";
   // sdp << "a=sctp-port:5000\r\n";
-  // sdp << "a=max-message-size:100000\r\n";
+  sdp << "a=max-message-size:" << transport_config_.sctp.max_message_size << "\r\n";
   sdp << "a=setup:actpass\r\n";
   sdp << "a=dtls-id:1\r\n";
   sdp << this->nice->GenerateLocalSDP();
   sdp << "a=fingerprint:sha-256 " << dtls->Certificate().fingerprint() << "\r\n";
-  sdp << "a=sctpmap:5000 webrtc-datachannel 262144\r\n";
+  // The last sctpmap field is the stream count, the message size limit is a=max-message-size
+  sdp << "a=sctpmap:5000 webrtc-datachannel 1024\r\n";
 
+  // The offer carries no a=mid, so candidates go out with an empty sdpMid from now on
+  ReleaseEarlyCandidates();
   return sdp.str();
   }
 std::string PeerConnection::GenerateAnswer() {
@@ -153,6 +170,9 @@ std::string PeerConnection::GenerateAnswer() {
   sdp << "o=- " << session_id << " 2 IN IP4 0.0.0.0\r\n";  // Session ID
   sdp << "s=-\r\n";
   sdp << "t=0 0\r\n";
+  if (transport_config_.ice_lite || transport_config_.udp_mux) {
+    sdp << "a=ice-lite\r\n";
+  }
   sdp << "a=msid-semantic: WMS\r\n";
   sdp << "m=application 9 DTLS/SCTP 5000\r\n";  // XXX: hardcoded port
   sdp << "c=IN IP4 0.0.0.0\r\n";
@@ -160,8 +180,12 @@ std::string PeerConnection::GenerateAnswer() {
   sdp << "a=fingerprint:sha-256 " << dtls->Certificate().fingerprint() << "\r\n";
   sdp << "a=ice-options:trickle\r\n";
   sdp << "a=setup:" << (this->role == Client ? "active" : "passive") << "\r\n";
-  sdp << "a=mid:" << this->mid << "\r\n";
+  {
+    std::lock_guard<std::mutex> lock(mid_mutex);
+    sdp << "a=mid:" << this->mid << "\r\n";
+  }
   sdp << "a=sctpmap:5000 webrtc-datachannel 1024\r\n";
+  sdp << "a=max-message-size:" << transport_config_.sctp.max_message_size << "\r\n";
 
   return sdp.str();
 }
@@ -178,11 +202,43 @@ void PeerConnection::OnLocalIceCandidate(std::string &ice_candidate) {
     if (ice_candidate.size() > 2) {
       ice_candidate = ice_candidate.substr(2);
     }
-    IceCandidate candidate(ice_candidate, this->mid, 0);
+    std::lock_guard<std::mutex> order_lock(candidates_mutex);
+    std::string cur_mid;
+    {
+      std::lock_guard<std::mutex> lock(mid_mutex);
+      if (!mid_known) {
+        // Gathering on initialize can finish before the answering side has seen the offer's a=mid
+        early_candidates.push_back(ice_candidate);
+        return;
+      }
+      cur_mid = this->mid;
+    }
+    IceCandidate candidate(ice_candidate, cur_mid, 0);
     this->ice_candidate_cb(candidate);
   }
 }
 
+void PeerConnection::ReleaseEarlyCandidates() {
+  std::lock_guard<std::mutex> order_lock(candidates_mutex);
+  std::vector<std::string> candidates;
+  std::string cur_mid;
+  {
+    std::lock_guard<std::mutex> lock(mid_mutex);
+    if (mid_known) {
+      return;
+    }
+    mid_known = true;
+    candidates.swap(early_candidates);
+    cur_mid = this->mid;
+  }
+  if (this->ice_candidate_cb) {
+    for (const auto &ice_candidate : candidates) {
+      IceCandidate candidate(ice_candidate, cur_mid, 0);
+      this->ice_candidate_cb(candidate);
+    }
+  }
+}
+
 void PeerConnection::OnIceReady() {
   if (!iceReady) {
     iceReady = true;
@@ -194,12 +250,71 @@ void PeerConnection::OnIceReady() {
 }
 
 void PeerConnection::OnDTLSHandshakeDone() {
+  // Only now is the cipher, and with it the room DTLS needs in each datagram, known
+  this->sctp->SetPathMtu(transport_config_.path_mtu, this->dtls->GetRecordOverhead(), transport_config_.max_path_mtu);
   this->sctp->Start();
 }
 
+void PeerConnection::OnDTLSHandshakeFailed() {
+  if (this->error_cb) {
+    this->error_cb("DTLS handshake failed");
+  }
+}
+
+void PeerConnection::SetOnErrorCallback(std::function<void(std::string description)> error_cb) { this->error_cb = error_cb; }
+
+void PeerConnection::SetSctpInitialCwnd(uint32_t mtus) { SCTPWrapper::SetInitialCwnd(mtus); }
+
+RTCTransportStats PeerConnection::GetTransportStats() const {
+  RTCTransportStats stats;
+  stats.dtls = this->dtls->GetStats();
+  stats.sctp = this->sctp->GetStats();
+  stats.path_mtu = this->sctp->GetPathMtu();
+  return stats;
+}
+
 // Matches DataChannel onmessage
-void PeerConnection::OnSCTPMsgReceived(ChunkPtr chunk, uint16_t sid, uint32_t ppid) {
+void PeerConnection::OnSCTPMsgReceived(ChunkPtr chunk, uint16_t sid, uint32_t ppid, bool is_last) {
 //    std::cerr << "PeerConnection::OnSCTPMsgReceived, new message, sid = " << sid << '\n';
+  if (!chunk) {
+    // Partial delivery aborted, whatever we have of the message is useless
+    partial_messages.erase(sid);
+    auto cur_channel = GetChannel(sid);
+    if (cur_channel) {
+      cur_channel->OnError("Partial delivery aborted");
+    }
+    return;
+  }
+
+  if (ppid == PPID_STRING || ppid == PPID_BINARY) {
+    auto cur_channel = GetChannel(sid);
+    if (cur_channel && cur_channel->fragment_cb) {
+      cur_channel->OnFragment(chunk, is_last);
+      return;
+    }
+  }
+
+  auto partial = partial_messages.find(sid);
+  if (!is_last || partial != partial_messages.end()) {
+    auto &pieces = partial_messages[sid];
+    pieces.push_back(chunk);
+    if (!is_last) {
+      return;
+    }
+
+    size_t total_len = 0;
+    for (auto &piece : pieces) {
+      total_len += piece->Length();
+    }
+    chunk = std::make_shared<Chunk>(total_len);
+    size_t offset = 0;
+    for (auto &piece : pieces) {
+      memcpy(chunk->Data() + offset, piece->Data(), piece->Length());
+      offset += piece->Length();
+    }
+    partial_messages.erase(sid);
+  }
+
   if (ppid == PPID_CONTROL) {
     if (chunk->Data()[0] == DC_TYPE_OPEN) {
 //        std::cerr << "PeerConnection::OnSCTPMsgReceived, open data channel, sid = " << sid << '\n';
@@ -225,14 +340,23 @@ void PeerConnection::OnSCTPMsgReceived(ChunkPtr chunk, uint16_t sid, uint32_t pp
 }
 
 std::shared_ptr<DataChannel> PeerConnection::GetChannel(uint16_t sid) {
+  std::lock_guard<std::mutex> lock(channels_mutex);
   auto iter = data_channels.find(sid);
   if (iter != data_channels.end()) {
-    return data_channels[sid];
+    return iter->second;
   }
 
   return std::shared_ptr<DataChannel>();
 }
 
+void PeerConnection::RemoveChannel(uint16_t sid, const std::shared_ptr<DataChannel> &channel) {
+  std::lock_guard<std::mutex> lock(channels_mutex);
+  auto iter = data_channels.find(sid);
+  if (iter != data_channels.end() && iter->second == channel) {
+    data_channels.erase(iter);
+  }
+}
+
 void PeerConnection::HandleNewDataChannel(ChunkPtr chunk, uint16_t sid) {
   uint8_t *raw_msg = chunk->Data();
   dc_open_msg open_msg;
@@ -242,15 +366,20 @@ void PeerConnection::HandleNewDataChannel(ChunkPtr chunk, uint16_t sid) {
   open_msg.label_len = (raw_msg[8] << 8) + raw_msg[9];
   open_msg.protocol_len = (raw_msg[10] << 8) + raw_msg[11];
   uint32_t reliability = open_msg.reliability;
+  uint16_t priority = open_msg.priority;
   std::string label(reinterpret_cast<char *>(raw_msg + 12), open_msg.label_len);
   std::string protocol(reinterpret_cast<char *>(raw_msg + 12 + open_msg.label_len), open_msg.protocol_len);
 
   // TODO: Support overriding an existing channel
-  auto new_channel = std::make_shared<DataChannel>(this, sid, open_msg.chan_type, label, protocol, reliability);
+  auto new_channel = std::make_shared<DataChannel>(this, sid, open_msg.chan_type, label, protocol, reliability, priority);
 
-  data_channels[sid] = new_channel;
+  {
+    std::lock_guard<std::mutex> lock(channels_mutex);
+    data_channels[sid] = new_channel;
+  }
   this->sctp->SetDataChannelSID(sid);
-  this->sctp->SendACK(open_msg.chan_type, open_msg.reliability);
+  this->sctp->SetStreamPriority(sid, priority);
+  this->sctp->SendACK(sid);
   if (this->new_channel_cb) {
     this->new_channel_cb(new_channel);
   } else {
@@ -278,6 +407,9 @@ void PeerConnection::HandleDataChannelClose(uint16_t sid) {
     //std::cerr << "Received close for unknown channel: " << sid << '\n';
     return;
   }
+  // Both directions of the stream are reset, so its id is free for a new channel
+  RemoveChannel(sid, cur_channel);
+  partial_messages.erase(sid);
   cur_channel->OnClosed();
 }
 
@@ -302,11 +434,16 @@ void PeerConnection::HandleBinaryMessage(ChunkPtr chunk, uint16_t sid) {
   cur_channel->OnBinaryMsg(chunk);
 }
 
+static bool ExceedsMaxMessageSize(size_t len, uint32_t max_message_size) { return max_message_size > 0 && len > max_message_size; }
+
 void PeerConnection::SendStrMsg(std::string str_msg, uint16_t sid) {
   auto chan = GetChannel(sid);
   if (chan) {
+    if (ExceedsMaxMessageSize(str_msg.size(), remote_max_message_size)) {
+      throw std::runtime_error("Message exceeds the remote max-message-size");
+    }
     auto cur_msg = std::make_shared<Chunk>((const uint8_t *)str_msg.c_str(), str_msg.size());
-    this->sctp->GSForSCTP(cur_msg, sid, PPID_STRING);
+    this->sctp->GSForSCTP(cur_msg, sid, PPID_STRING, chan->chan_type, chan->reliability, true, chan->bundled);
   } else {
     throw std::runtime_error("Datachannel does not exist");
   }
@@ -315,8 +452,25 @@ void PeerConnection::SendStrMsg(std::string str_msg, uint16_t sid) {
 void PeerConnection::SendBinaryMsg(const uint8_t *data, int len, uint16_t sid) {
   auto chan = GetChannel(sid);
   if (chan) {
+    if (ExceedsMaxMessageSize(len, remote_max_message_size)) {
+      throw std::runtime_error("Message exceeds the remote max-message-size");
+    }
     auto cur_msg = std::make_shared<Chunk>(data, len);
-    this->sctp->GSForSCTP(cur_msg, sid, PPID_BINARY);
+    this->sctp->GSForSCTP(cur_msg, sid, PPID_BINARY, chan->chan_type, chan->reliability, true, chan->bundled);
+  } else {
+    throw std::runtime_error("Datachannel does not exist");
+  }
+}
+
+void PeerConnection::SendBinaryFragment(const uint8_t *data, int len, uint16_t sid, bool is_last) {
+  auto chan = GetChannel(sid);
+  if (chan) {
+    if (ExceedsMaxMessageSize(chan->fragment_bytes_sent + len, remote_max_message_size)) {
+      throw std::runtime_error("Message exceeds the remote max-message-size");
+    }
+    auto cur_msg = std::make_shared<Chunk>(data, len);
+    this->sctp->GSForSCTP(cur_msg, sid, PPID_BINARY, chan->chan_type, chan->reliability, is_last, chan->bundled);
+    chan->fragment_bytes_sent = is_last ? 0 : chan->fragment_bytes_sent + len;
   } else {
     throw std::runtime_error("Datachannel does not exist");
   }
@@ -327,31 +481,45 @@ void PeerConnection::StopSendData()
     sctp->StopSend();
 }
 
-std::shared_ptr<DataChannel> PeerConnection::CreateDataChannel(std::string label, std::string protocol, uint8_t chan_type, uint32_t reliability) {
-  uint16_t sid;
-  if (this->role == 0) {
-    sid = 0;
-  } else {
-    sid = 1;
-  }
-  for (int i = sid; i < data_channels.size(); i = i + 2) {
-    auto iter = data_channels.find(i);
-    if (iter == data_channels.end()) {
-      sid = i;
-      break;
+void PeerConnection::Flush() { this->sctp->Flush(); }
+
+std::shared_ptr<DataChannel> PeerConnection::CreateDataChannel(std::string label, std::string protocol, uint8_t chan_type, uint32_t reliability,
+                                                               uint16_t priority) {
+  // The DTLS client takes even stream ids, the server odd ones (RFC 8832)
+  uint32_t free_sid = this->role == Client ? 0 : 1;
+  std::shared_ptr<DataChannel> new_channel;
+  {
+    std::lock_guard<std::mutex> lock(channels_mutex);
+    while (data_channels.find(free_sid) != data_channels.end()) {
+      free_sid += 2;
     }
+    if (free_sid >= transport_config_.sctp.max_streams) {
+      throw std::runtime_error("No stream id left for a new data channel");
+    }
+    new_channel = std::make_shared<DataChannel>(this, (uint16_t)free_sid, chan_type, label, protocol, reliability, priority);
+    data_channels[(uint16_t)free_sid] = new_channel;
   }
+  uint16_t sid = (uint16_t)free_sid;
 
   this->sctp->SetDataChannelSID(sid);
 
-  auto new_channel = std::make_shared<DataChannel>(this, sid, chan_type, label, protocol, reliability);
-  data_channels[sid] = new_channel;
-
-  std::thread create_dc = std::thread(&SCTPWrapper::CreateDCForSCTP, sctp.get(), label, protocol, chan_type, reliability);
-  create_dc.detach();
+  // Runs on the SCTP open thread, which Stop() joins before the PeerConnection goes away
+  std::weak_ptr<DataChannel> weak_channel = new_channel;
+  this->sctp->CreateDCForSCTP(sid, label, protocol, chan_type, reliability, priority, [this, sid, weak_channel](const std::string &error) {
+    auto channel = weak_channel.lock();
+    if (!channel) {
+      return;
+    }
+    RemoveChannel(sid, channel);
+    channel->OnError(error);
+  });
   return new_channel;
 }
 void PeerConnection::ResetSCTPStream(uint16_t stream_id) {
   this->sctp->ResetSCTPStream(stream_id, SCTP_STREAM_RESET_OUTGOING);
 }
+
+void PeerConnection::CloseDataChannels(const std::vector<uint16_t> &stream_ids) {
+  this->sctp->ResetSCTPStreams(stream_ids, SCTP_STREAM_RESET_OUTGOING);
+}
 }
@@ -35,6 +35,10 @@
 #include <cstring>
 #include <unistd.h>
 #include <cstdarg>
+#include <algorithm>
+#include <array>
+
+#include "openssl/rand.h"
 
 #include "SCTPWrapper.hpp"
 
@@ -42,8 +46,9 @@
 namespace rtcdcpp {
 
 using namespace std;
-SCTPWrapper::SCTPWrapper(DTLSEncryptCallbackPtr dtlsEncryptCB, MsgReceivedCallbackPtr msgReceivedCB)
-    : local_port(5000),  // XXX: Hard-coded for now
+SCTPWrapper::SCTPWrapper(DTLSEncryptCallbackPtr dtlsEncryptCB, MsgReceivedCallbackPtr msgReceivedCB, const RTCSctpConfiguration &config)
+    : config(config),
+      local_port(5000),  // XXX: Hard-coded for now
       remote_port(5000),
       stream_cursor(0),
       dtlsEncryptCallback(dtlsEncryptCB),
@@ -56,6 +61,7 @@ SCTPWrapper::~SCTPWrapper() {
   while (usrsctp_finish() != 0 && tries < 5) {
     std::this_thread::sleep_for(std::chrono::milliseconds(1000));
   }
+  free(this->data);
 }
 
 static uint16_t interested_events[] = {SCTP_ASSOC_CHANGE,         SCTP_PEER_ADDR_CHANGE,   SCTP_REMOTE_ERROR,          SCTP_SEND_FAILED,
@@ -72,6 +78,23 @@ void SCTPWrapper::OnNotification(union sctp_notification *notify, size_t len) {
 
   switch (notify->sn_header.sn_type) {
     case SCTP_ASSOC_CHANGE:
+      switch (notify->sn_assoc_change.sac_state) {
+        case SCTP_COMM_UP:
+        case SCTP_RESTART:
+          {
+            std::lock_guard<std::mutex> lock(streams_mutex);
+            outbound_streams = notify->sn_assoc_change.sac_outbound_streams;
+            inbound_streams = notify->sn_assoc_change.sac_inbound_streams;
+          }
+          streams_cv.notify_all();
+          assoc_up = true;
+          break;
+        case SCTP_COMM_LOST:
+        case SCTP_SHUTDOWN_COMP:
+        case SCTP_CANT_STR_ASSOC:
+          assoc_up = false;
+          break;
+      }
       break;
     case SCTP_PEER_ADDR_CHANGE:
       break;
@@ -84,6 +107,10 @@ void SCTPWrapper::OnNotification(union sctp_notification *notify, size_t len) {
     case SCTP_ADAPTATION_INDICATION:
       break;
     case SCTP_PARTIAL_DELIVERY_EVENT:
+      if (notify->sn_pdapi_event.pdapi_indication == SCTP_PARTIAL_DELIVERY_ABORTED) {
+        // The rest of the message will never arrive
+        this->msgReceivedCallback(ChunkPtr(), (uint16_t)notify->sn_pdapi_event.pdapi_stream, 0, true);
+      }
       break;
     case SCTP_AUTHENTICATION_EVENT:
       break;
@@ -92,51 +119,28 @@ void SCTPWrapper::OnNotification(union sctp_notification *notify, size_t len) {
     case SCTP_NOTIFICATIONS_STOPPED_EVENT:
       break;
     case SCTP_STREAM_RESET_EVENT:
-      // Close datachannel
-      
-      struct sctp_stream_reset_event* reset_event;
-      reset_event = &notify->sn_strreset_event;
-      uint32_t e_length;
-      e_length = reset_event->strreset_length;
-      size_t list_len;
-      list_len = e_length - sizeof(*reset_event);
-      list_len /= sizeof(uint16_t);
-      for (int i = 0; i < list_len; i++) {
-        uint16_t streamid = reset_event->strreset_stream_list[i];
-        uint16_t set_flags = 0;
-        if (reset_event->strreset_flags != 0) {
-          if ((reset_event->strreset_flags ^ SCTP_STREAM_RESET_INCOMING_SSN) == 0) {
-            set_flags = SCTP_STREAM_RESET_OUTGOING;  
-          }
-          if ((reset_event->strreset_flags ^ SCTP_STREAM_RESET_OUTGOING_SSN) == 0) {
-            //fires when we close the stream from our side explicity or
-            //as a result of remote close or some error.
-            
-            const uint8_t dc_close_data = DC_TYPE_CLOSE;
-            const uint8_t *dc_close_ptr = &dc_close_data;
-            OnMsgReceived(dc_close_ptr, sizeof(dc_close_ptr), streamid, PPID_CONTROL);
-            //The above signals to call our onClose callback
-          }
-          if ((reset_event->strreset_flags ^ SCTP_STREAM_RESET_DENIED) == 0) {
-			//std::cerr << "Stream reset denied by peer\n";
-          }
-          if ((reset_event->strreset_flags ^ SCTP_STREAM_RESET_FAILED) == 0) {
-			//std::cerr << "Stream reset failed\n";
-          }
-        } else {
-          continue;
-        }
-        if (set_flags == SCTP_STREAM_RESET_OUTGOING) {
-          // Reset the stream when a remote close is received.
-          ResetSCTPStream(streamid, set_flags);
-          // This will cause another event SCTP_STREAM_RESET_OUTGOING_SSN 
-          // where we can finally call our callbacks.
-        }
-      }
+      // Close datachannels
+      OnStreamReset(&notify->sn_strreset_event);
       break;
     case SCTP_ASSOC_RESET_EVENT:
       break;
     case SCTP_STREAM_CHANGE_EVENT:
+      {
+        // Either our SCTP_ADD_STREAMS was answered or the peer added streams
+        const struct sctp_stream_change_event &change = notify->sn_strchange_event;
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        if (change.strchange_flags & (SCTP_STREAM_CHANGE_DENIED | SCTP_STREAM_CHANGE_FAILED)) {
+          streams_change_failed = true;
+          streams_change_pending = false;
+        } else {
+          outbound_streams = change.strchange_outstrms;
+          inbound_streams = change.strchange_instrms;
+          if (outbound_streams >= streams_requested_out && inbound_streams >= streams_requested_in) {
+            streams_change_pending = false;
+          }
+        }
+      }
+      streams_cv.notify_all();
       break;
     default:
       break;
@@ -152,6 +156,18 @@ int SCTPWrapper::_OnSCTPForDTLS(void *sctp_ptr, void *data, size_t len, uint8_t
 }
 
 int SCTPWrapper::OnSCTPForDTLS(void *data, size_t len, uint8_t tos, uint8_t set_df) {
+  // Remember the peer's verification tag for our MTU probes, INITs carry zero
+  if (len >= 12) {
+    uint32_t vtag;
+    memcpy(&vtag, (const uint8_t *)data + 4, sizeof(vtag));
+    if (vtag != 0) {
+      peer_vtag = vtag;
+    }
+  }
+
+  packets_sent.fetch_add(1, std::memory_order_relaxed);
+  bytes_sent.fetch_add(len, std::memory_order_relaxed);
+  CountRetransmissions((const uint8_t *)data, len);
   this->dtlsEncryptCallback(std::make_shared<Chunk>(data, len));
 
   {
@@ -190,14 +206,117 @@ int SCTPWrapper::OnSCTPForGS(struct socket *sock, union sctp_sockstore addr, voi
     OnNotification((union sctp_notification *)data, len);
   } else {
     //std::cout << "Got msg of size: " << len << "\n";
-    OnMsgReceived((const uint8_t *)data, len, recv_info.rcv_sid, ntohl(recv_info.rcv_ppid));
+    // usrsctp malloc'd the buffer for us, hand it on as is and let the last user free it.
+    // Without MSG_EOR this is one piece of a larger message, cut at the partial delivery point
+    OnMsgReceived(std::make_shared<Chunk>(data, len, &free), recv_info.rcv_sid, ntohl(recv_info.rcv_ppid), (flags & MSG_EOR) != 0);
+    return 0;
   }
   free(data);
   return 0;
 }
 
-void SCTPWrapper::OnMsgReceived(const uint8_t *data, size_t len, int ppid, int sid) {
-  this->msgReceivedCallback(std::make_shared<Chunk>(data, len), ppid, sid);
+void SCTPWrapper::_OnSCTPUpcall(struct socket *sock, void *arg, int flags) {
+  if (arg) {
+    static_cast<SCTPWrapper *>(arg)->OnSCTPUpcall(usrsctp_get_events(sock));
+  }
+}
+
+void SCTPWrapper::OnSCTPUpcall(int events) {
+  // Called with usrsctp locks held, just wake the delivery thread
+  if (events & (SCTP_EVENT_READ | SCTP_EVENT_ERROR)) {
+    std::lock_guard<std::mutex> lock(delivery_mutex);
+    readable = true;
+    delivery_cv.notify_one();
+  }
+}
+
+void SCTPWrapper::RunDelivery() {
+  struct Received {
+    ChunkPtr chunk;
+    struct sctp_rcvinfo info;
+    int flags;
+  };
+  std::vector<Received> batch;
+  std::vector<uint8_t> buf(SCTP_DELIVERY_BUFFER_SIZE);
+
+  while (!this->should_stop) {
+    {
+      std::unique_lock<std::mutex> lock(delivery_mutex);
+      delivery_cv.wait(lock, [this] { return readable || should_stop; });
+      readable = false;
+    }
+
+    // Take everything usrsctp has queued, then run the handlers without holding up usrsctp
+    batch.clear();
+    while (!this->should_stop) {
+      Received received;
+      memset(&received.info, 0, sizeof(received.info));
+      struct sockaddr_conn from;
+      socklen_t from_len = sizeof(from);
+      socklen_t info_len = sizeof(received.info);
+      unsigned int info_type = 0;
+      received.flags = 0;
+      ssize_t len = usrsctp_recvv(this->sock, buf.data(), buf.size(), (struct sockaddr *)&from, &from_len, &received.info, &info_len, &info_type,
+                                  &received.flags);
+      if (len <= 0) {
+        // EWOULDBLOCK, the next upcall wakes us
+        break;
+      }
+      received.chunk = std::make_shared<Chunk>(buf.data(), len);
+      batch.push_back(received);
+    }
+
+    for (auto &received : batch) {
+      if (received.flags & MSG_NOTIFICATION) {
+        OnNotification((union sctp_notification *)received.chunk->Data(), received.chunk->Length());
+      } else {
+        OnMsgReceived(received.chunk, received.info.rcv_sid, ntohl(received.info.rcv_ppid), (received.flags & MSG_EOR) != 0);
+      }
+    }
+  }
+}
+
+void SCTPWrapper::OnMsgReceived(ChunkPtr chunk, uint16_t sid, uint32_t ppid, bool is_last) {
+  this->msgReceivedCallback(chunk, sid, ppid, is_last);
+}
+
+static uint32_t StreamSchedulerValue(SctpStreamScheduler scheduler) {
+  switch (scheduler) {
+    case SctpStreamScheduler::FirstCome:
+      return SCTP_SS_FIRST_COME;
+    case SctpStreamScheduler::RoundRobinPacket:
+      return SCTP_SS_ROUND_ROBIN_PACKET;
+    case SctpStreamScheduler::Priority:
+      return SCTP_SS_PRIORITY;
+    case SctpStreamScheduler::FairBandwidth:
+      return SCTP_SS_FAIR_BANDWITH;
+    case SctpStreamScheduler::RoundRobin:
+    default:
+      return SCTP_SS_ROUND_ROBIN;
+  }
+}
+
+static uint32_t CongestionControlValue(SctpCongestionControl congestion_control) {
+  switch (congestion_control) {
+    case SctpCongestionControl::HighSpeedTcp:
+      return SCTP_CC_HSTCP;
+    case SctpCongestionControl::HTcp:
+      return SCTP_CC_HTCP;
+    case SctpCongestionControl::RealTime:
+      return SCTP_CC_RTCC;
+    case SctpCongestionControl::Rfc2581:
+    default:
+      return SCTP_CC_RFC2581;
+  }
+}
+
+std::atomic<uint32_t> SCTPWrapper::initial_cwnd{0};
+
+void SCTPWrapper::SetInitialCwnd(uint32_t mtus) {
+  initial_cwnd = mtus;
+  if (mtus == 0) {
+    usrsctp_sysctl_set_sctp_initial_cwnd(SCTP_INITIAL_CWND_DEFAULT);
+  }
 }
 
 bool SCTPWrapper::Initialize() {
@@ -228,16 +347,26 @@ bool SCTPWrapper::Initialize() {
   usrsctp_sysctl_set_sctp_pr_enable(1);
 
   // Set amount of incoming streams
-  usrsctp_sysctl_set_sctp_nr_incoming_streams_default(MAX_IN_STREAM);
+  usrsctp_sysctl_set_sctp_nr_incoming_streams_default(config.max_streams);
 
   // Set amount of outgoing streams
-  usrsctp_sysctl_set_sctp_nr_outgoing_streams_default(MAX_OUT_STREAM);
+  usrsctp_sysctl_set_sctp_nr_outgoing_streams_default(config.initial_streams);
 
   // Enable interleaving messages for different streams (incoming)
   // See: https://tools.ietf.org/html/rfc6458#section-8.1.20
   usrsctp_sysctl_set_sctp_default_frag_interleave(2);
 
-  sock = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP, &SCTPWrapper::_OnSCTPForGS, NULL,  usrsctp_sysctl_get_sctp_sendspace() / 2, this);
+  uint32_t cwnd = initial_cwnd;
+  if (cwnd > 0) {
+    usrsctp_sysctl_set_sctp_initial_cwnd(cwnd);
+  }
+
+  uint32_t send_space = config.send_buffer > 0 ? config.send_buffer : usrsctp_sysctl_get_sctp_sendspace();
+  if (config.receive_upcall) {
+    sock = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP, NULL, NULL, 0, NULL);
+  } else {
+    sock = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP, &SCTPWrapper::_OnSCTPForGS, NULL, send_space / 2, this);
+  }
   if (!sock) {
 	//std::cerr << "Could not create usrsctp_socket. errno= " << errno << '\n';
     return false;
@@ -252,18 +381,30 @@ bool SCTPWrapper::Initialize() {
   }
 
 
-  struct sctp_paddrparams peer_param;
-  memset(&peer_param, 0, sizeof(peer_param));
-  peer_param.spp_flags = SPP_PMTUD_DISABLE;
-  peer_param.spp_pathmtu = 1200;  // XXX: Does this need to match the actual MTU?
-  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &peer_param, sizeof(peer_param)) == -1) {
-	//std::cerr << "Could not set socket options for SCTP_PEER_ADDR_PARAMS. errno= " << errno << '\n';
+  if (config.send_buffer > 0) {
+    int send_buffer = (int)config.send_buffer;
+    if (usrsctp_setsockopt(this->sock, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer)) == -1) {
+	  //std::cerr << "Could not set socket options for SO_SNDBUF. errno= " << errno << '\n';
+      return false;
+    }
+  }
+
+  if (config.receive_buffer > 0) {
+    int receive_buffer = (int)config.receive_buffer;
+    if (usrsctp_setsockopt(this->sock, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer)) == -1) {
+	  //std::cerr << "Could not set socket options for SO_RCVBUF. errno= " << errno << '\n';
+      return false;
+    }
+  }
+
+  if (!ApplyPathMtu()) {
     return false;
   }
 
+  // Stream resets close data channels, stream additions let the peer grow the association
   struct sctp_assoc_value av;
   av.assoc_id = SCTP_ALL_ASSOC;
-  av.assoc_value = 1;
+  av.assoc_value = SCTP_ENABLE_RESET_STREAM_REQ | SCTP_ENABLE_CHANGE_ASSOC_REQ;
   if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &av, sizeof(av)) == -1) {
 	//std::cerr << "Could not set socket options for SCTP_ENABLE_STREAM_RESET. errno= " << errno << '\n';
     return false;
@@ -275,6 +416,53 @@ bool SCTPWrapper::Initialize() {
     return false;
   }
 
+  // Messages end only where a send carries SCTP_EOR, which lets large messages be sent in pieces
+  int explicit_eor = 1;
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_EXPLICIT_EOR, &explicit_eor, sizeof(explicit_eor)) == -1) {
+	//std::cerr << "Could not set socket options for SCTP_EXPLICIT_EOR. errno= " << errno << '\n';
+    return false;
+  }
+
+  if (config.partial_delivery_point > 0) {
+    uint32_t pd_point = config.partial_delivery_point;
+    if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_PARTIAL_DELIVERY_POINT, &pd_point, sizeof(pd_point)) == -1) {
+	  //std::cerr << "Could not set socket options for SCTP_PARTIAL_DELIVERY_POINT. errno= " << errno << '\n';
+      return false;
+    }
+  }
+
+  // Full fragment interleaving on receive, which I-DATA requires
+  int interleave_level = 2;
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_FRAGMENT_INTERLEAVE, &interleave_level, sizeof(interleave_level)) == -1) {
+	//std::cerr << "Could not set socket options for SCTP_FRAGMENT_INTERLEAVE. errno= " << errno << '\n';
+    return false;
+  }
+
+  if (config.message_interleaving) {
+    av.assoc_id = SCTP_FUTURE_ASSOC;
+    av.assoc_value = 1;
+    if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_INTERLEAVING_SUPPORTED, &av, sizeof(av)) == -1) {
+	  //std::cerr << "Could not set socket options for SCTP_INTERLEAVING_SUPPORTED. errno= " << errno << '\n';
+      return false;
+    }
+  }
+
+  av.assoc_id = SCTP_FUTURE_ASSOC;
+  av.assoc_value = CongestionControlValue(config.congestion_control);
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_PLUGGABLE_CC, &av, sizeof(av)) == -1) {
+	//std::cerr << "Could not set socket options for SCTP_PLUGGABLE_CC. errno= " << errno << '\n';
+    return false;
+  }
+
+  // With I-DATA the scheduler picks a stream per chunk rather than per message, so anything but
+  // first come lets messages on other channels slip in between the fragments of a large one.
+  av.assoc_id = SCTP_FUTURE_ASSOC;
+  av.assoc_value = StreamSchedulerValue(config.scheduler);
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_PLUGGABLE_SS, &av, sizeof(av)) == -1) {
+	//std::cerr << "Could not set socket options for SCTP_PLUGGABLE_SS. errno= " << errno << '\n';
+    return false;
+  }
+
   /* Enable the events of interest */
   struct sctp_event event;
   memset(&event, 0, sizeof(event));
@@ -291,8 +479,8 @@ bool SCTPWrapper::Initialize() {
 
   struct sctp_initmsg init_msg;
   memset(&init_msg, 0, sizeof(init_msg));
-  init_msg.sinit_num_ostreams = MAX_OUT_STREAM;
-  init_msg.sinit_max_instreams = MAX_IN_STREAM;
+  init_msg.sinit_num_ostreams = config.initial_streams;
+  init_msg.sinit_max_instreams = config.max_streams;
   if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_INITMSG, &init_msg, sizeof(init_msg)) == -1) {
 	//std::cerr << "Could not set socket options for SCTP_INITMSG. errno= " << errno << '\n';
     return false;
@@ -303,6 +491,19 @@ bool SCTPWrapper::Initialize() {
     return false;
   }
 
+  if (config.receive_upcall) {
+    // usrsctp_recvv reports the stream and ppid only when asked to
+    int on = 1;
+    if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_RECVRCVINFO, &on, sizeof(on)) == -1) {
+	  //std::cerr << "Could not set socket options for SCTP_RECVRCVINFO. errno= " << errno << '\n';
+      return false;
+    }
+    if (usrsctp_set_upcall(this->sock, &SCTPWrapper::_OnSCTPUpcall, this) < 0) {
+	  //std::cerr << "Could not set upcall. errno= " << errno << '\n';
+      return false;
+    }
+  }
+
   struct sockaddr_conn sconn;
   sconn.sconn_family = AF_CONN;
   sconn.sconn_port = htons(remote_port);
@@ -328,6 +529,12 @@ void SCTPWrapper::Start() {
   started = true;
 
   this->recv_thread = std::thread(&SCTPWrapper::RecvLoop, this);
+  if (config.receive_upcall) {
+    this->delivery_thread = std::thread(&SCTPWrapper::RunDelivery, this);
+  }
+  if (config.bundling) {
+    this->flush_thread = std::thread(&SCTPWrapper::RunFlush, this);
+  }
   this->connect_thread = std::thread(&SCTPWrapper::RunConnect, this);
 }
 
@@ -338,6 +545,22 @@ void SCTPWrapper::Stop() {
   recv_queue.Stop();
 
   connectCV.notify_one();  // unblock the recv thread in case we never connected
+  {
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    streams_cv.notify_all();  // and anyone waiting for new streams
+  }
+  {
+    std::lock_guard<std::mutex> lock(createDCMtx);
+    createDC.notify_all();  // or for the association to come up
+  }
+  {
+    std::lock_guard<std::mutex> lock(open_mutex);
+    open_requests.clear();
+    open_cv.notify_all();
+  }
+  if (this->open_thread.joinable()) {
+    this->open_thread.join();
+  }
   if (this->recv_thread.joinable()) {
     this->recv_thread.join();
   }
@@ -346,31 +569,355 @@ void SCTPWrapper::Stop() {
     this->connect_thread.join();
   }
 
-  if (sock) {
-    usrsctp_shutdown(sock, SHUT_RDWR);
-    usrsctp_close(sock);
-    sock = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(delivery_mutex);
+    delivery_cv.notify_all();
+  }
+  if (this->delivery_thread.joinable()) {
+    this->delivery_thread.join();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    flush_cv.notify_all();
+  }
+  if (this->flush_thread.joinable()) {
+    this->flush_thread.join();
+  }
+  if (assoc_up) {
+    // Let held messages leave with the graceful shutdown
+    Flush();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(sock_mutex);
+    if (sock) {
+      usrsctp_shutdown(sock, SHUT_RDWR);
+      usrsctp_close(sock);
+      sock = nullptr;
+    }
   }
   usrsctp_deregister_address(this);
 }
 
-void SCTPWrapper::ResetSCTPStream(uint16_t stream_id, uint16_t srs_flags) {
-  struct sctp_reset_streams* stream_close = NULL;
-  size_t no_of_streams = 1;
-  size_t len = sizeof(stream_close) + sizeof(uint16_t);
-  stream_close = (sctp_reset_streams *) malloc(len);
-  memset(stream_close, 0, len);
-  stream_close->srs_flags = srs_flags;
-  stream_close->srs_number_streams = 1;
-  stream_close->srs_stream_list[0] = stream_id;
-  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_RESET_STREAMS, stream_close, static_cast<socklen_t>(reinterpret_cast<uintptr_t>(&len))) == -1) {
-	//std::cerr << "Could not set socket options for SCTP_RESET_STREAMS. errno= " << errno << '\n';
+void SCTPWrapper::OnStreamReset(const struct sctp_stream_reset_event *reset_event) {
+  size_t list_len = (reset_event->strreset_length - sizeof(*reset_event)) / sizeof(uint16_t);
+  uint16_t flags = reset_event->strreset_flags;
+
+  if (flags & (SCTP_STREAM_RESET_DENIED | SCTP_STREAM_RESET_FAILED)) {
+	//std::cerr << "Stream reset denied by peer or failed\n";
+  } else {
+    // A channel is closed once both directions are reset, whichever side started.
+    // The remote resetting its outgoing streams is a close we answer by resetting ours, all in one request.
+    std::vector<uint16_t> answer;
+    std::vector<uint16_t> closed;
+    {
+      std::lock_guard<std::mutex> lock(reset_mutex);
+      for (size_t i = 0; i < list_len; i++) {
+        uint16_t streamid = reset_event->strreset_stream_list[i];
+        if (flags & SCTP_STREAM_RESET_INCOMING_SSN) {
+          incoming_reset.insert(streamid);
+          if (outgoing_reset.insert(streamid).second) {
+            answer.push_back(streamid);
+          }
+        }
+        if (flags & SCTP_STREAM_RESET_OUTGOING_SSN) {
+          outgoing_reset_done.insert(streamid);
+        }
+        if (incoming_reset.count(streamid) && outgoing_reset_done.count(streamid)) {
+          // Fully closed, the stream id may be used again
+          incoming_reset.erase(streamid);
+          outgoing_reset.erase(streamid);
+          outgoing_reset_done.erase(streamid);
+          closed.push_back(streamid);
+        }
+      }
+    }
+    if (!answer.empty()) {
+      SendStreamReset(answer, SCTP_STREAM_RESET_OUTGOING);
+      // This will cause another event SCTP_STREAM_RESET_OUTGOING_SSN
+      // where the stream is finally closed.
+    }
+
+    const uint8_t dc_close_data = DC_TYPE_CLOSE;
+    for (uint16_t streamid : closed) {
+      //The below signals to call our onClose callback, after which the channel is dropped
+      OnMsgReceived(std::make_shared<Chunk>(&dc_close_data, sizeof(dc_close_data)), streamid, PPID_CONTROL);
+    }
+  }
+
+  // Our outstanding request has been answered, send whatever was held back meanwhile
+  std::vector<uint16_t> pending;
+  {
+    std::lock_guard<std::mutex> lock(reset_mutex);
+    pending.swap(pending_resets);
+  }
+  if (!pending.empty()) {
+    SendStreamReset(pending, SCTP_STREAM_RESET_OUTGOING);
+  }
+}
+
+void SCTPWrapper::ResetSCTPStream(uint16_t stream_id, uint16_t srs_flags) { ResetSCTPStreams(std::vector<uint16_t>{stream_id}, srs_flags); }
+
+void SCTPWrapper::ResetSCTPStreams(const std::vector<uint16_t> &stream_ids, uint16_t srs_flags) {
+  if (stream_ids.empty()) {
+    return;
+  }
+
+  if (srs_flags & SCTP_STREAM_RESET_OUTGOING) {
+    std::lock_guard<std::mutex> lock(reset_mutex);
+    outgoing_reset.insert(stream_ids.begin(), stream_ids.end());
+  }
+
+  SendStreamReset(stream_ids, srs_flags);
+}
+
+void SCTPWrapper::SendStreamReset(const std::vector<uint16_t> &stream_ids, uint16_t srs_flags) {
+  // One RE-CONFIG chunk for all of them
+  size_t len = sizeof(struct sctp_reset_streams) + stream_ids.size() * sizeof(uint16_t);
+  std::vector<uint8_t> buf(len);
+  struct sctp_reset_streams *reset = reinterpret_cast<struct sctp_reset_streams *>(buf.data());
+  reset->srs_assoc_id = 0;
+  reset->srs_flags = srs_flags;
+  reset->srs_number_streams = (uint16_t)stream_ids.size();
+  memcpy(reset->srs_stream_list, stream_ids.data(), stream_ids.size() * sizeof(uint16_t));
+
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_RESET_STREAMS, reset, (socklen_t)len) == -1) {
+    if ((errno == EALREADY || errno == EBUSY || errno == EINPROGRESS) && (srs_flags & SCTP_STREAM_RESET_OUTGOING)) {
+      // Only one request may be outstanding, these go out together when it is answered
+      std::lock_guard<std::mutex> lock(reset_mutex);
+      pending_resets.insert(pending_resets.end(), stream_ids.begin(), stream_ids.end());
+    } else {
+	  //std::cerr << "Could not set socket options for SCTP_RESET_STREAMS. errno= " << errno << '\n';
+    }
+  }
+}
+
+bool SCTPWrapper::ApplyPathMtu() {
+  // usrsctp's PMTUD only lowers the MTU on ICMP "too big" reports, which never reach an AF_CONN association
+  // tunnelled through DTLS and ICE, and spp_pathmtu merely pins a value. It stays off, SendProbe does the probing.
+  struct sctp_paddrparams peer_param;
+  memset(&peer_param, 0, sizeof(peer_param));
+  peer_param.spp_flags = SPP_PMTUD_DISABLE;
+  peer_param.spp_pathmtu = path_mtu - record_overhead;
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &peer_param, sizeof(peer_param)) == -1) {
+	//std::cerr << "Could not set socket options for SCTP_PEER_ADDR_PARAMS. errno= " << errno << '\n';
+    return false;
+  }
+  return true;
+}
+
+void SCTPWrapper::SetPathMtu(uint16_t path_mtu, uint16_t record_overhead, uint16_t max_path_mtu) {
+  this->path_mtu = path_mtu;
+  this->record_overhead = record_overhead;
+  this->probe_max_mtu = max_path_mtu > path_mtu ? max_path_mtu : 0;
+  this->probe_high = (uint32_t)this->probe_max_mtu + 1;
+  ApplyPathMtu();
+}
+
+void SCTPWrapper::SetPathMtuCallback(std::function<void(uint16_t path_mtu)> path_mtu_callback) { this->path_mtu_callback = path_mtu_callback; }
+
+RTCSctpStats SCTPWrapper::GetStats() const {
+  RTCSctpStats stats;
+  stats.packets_sent = packets_sent.load(std::memory_order_relaxed);
+  stats.packets_received = packets_received.load(std::memory_order_relaxed);
+  stats.bytes_sent = bytes_sent.load(std::memory_order_relaxed);
+  stats.bytes_received = bytes_received.load(std::memory_order_relaxed);
+  stats.sends_would_block = sends_would_block.load(std::memory_order_relaxed);
+  stats.send_retries = send_retries.load(std::memory_order_relaxed);
+  stats.sends_failed = sends_failed.load(std::memory_order_relaxed);
+  stats.retransmitted_chunks = retransmitted_chunks.load(std::memory_order_relaxed);
+  stats.retransmitted_bytes = retransmitted_bytes.load(std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(sock_mutex);
+  if (!this->sock || !assoc_up) {
+    return stats;
+  }
+
+  // AF_CONN associations have a single path, so the primary path info of SCTP_STATUS
+  // is all SCTP_GET_PEER_ADDR_INFO would report and saves a second query
+  struct sctp_status status;
+  memset(&status, 0, sizeof(status));
+  socklen_t len = sizeof(status);
+  if (usrsctp_getsockopt(this->sock, IPPROTO_SCTP, SCTP_STATUS, &status, &len) == -1) {
+	//std::cerr << "Could not get socket options for SCTP_STATUS. errno= " << errno << '\n';
+    return stats;
+  }
+  stats.state = status.sstat_state;
+  stats.peer_rwnd = status.sstat_rwnd;
+  stats.unacked_chunks = status.sstat_unackdata;
+  stats.pending_chunks = status.sstat_penddata;
+  stats.inbound_streams = status.sstat_instrms;
+  stats.outbound_streams = status.sstat_outstrms;
+  stats.cwnd = status.sstat_primary.spinfo_cwnd;
+  stats.srtt = std::chrono::milliseconds(status.sstat_primary.spinfo_srtt);
+  stats.rto = std::chrono::milliseconds(status.sstat_primary.spinfo_rto);
+  stats.mtu = status.sstat_primary.spinfo_mtu;
+  return stats;
+}
+
+static void WriteUint16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+static uint16_t ReadUint16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+
+static void WriteUint32(uint8_t *p, uint32_t value) {
+  WriteUint16(p, (uint16_t)(value >> 16));
+  WriteUint16(p + 2, (uint16_t)value);
+}
+
+static uint32_t ReadUint32(const uint8_t *p) { return ((uint32_t)ReadUint16(p) << 16) | ReadUint16(p + 2); }
+
+// CRC32c (Castagnoli) as used by the SCTP common header, RFC 4960 appendix B
+static uint32_t Crc32c(const uint8_t *data, size_t len) {
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+      }
+      t[i] = crc;
+    }
+    return t;
+  }();
+
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
   }
-  free(stream_close);
-  stream_close = NULL;
+  return ~crc;
 }
 
-void SCTPWrapper::DTLSForSCTP(ChunkPtr chunk) { this->recv_queue.push(chunk); }
+#define SCTP_CHUNK_DATA 0
+#define SCTP_CHUNK_HEARTBEAT 4
+#define SCTP_CHUNK_HEARTBEAT_ACK 5
+#define SCTP_CHUNK_IDATA 64
+#define SCTP_CHUNK_PAD 0x84
+#define SCTP_PARAM_HEARTBEAT_INFO 1
+#define SCTP_IDATA_HEADER_LEN 20
+
+void SCTPWrapper::CountRetransmissions(const uint8_t *packet, size_t len) {
+  // A DATA chunk carrying a TSN at or below the highest one sent is a retransmission, whether fast or on timeout
+  size_t offset = SCTP_COMMON_HEADER_LEN;
+  while (offset + 4 <= len) {
+    const uint8_t *chunk = packet + offset;
+    uint16_t chunk_len = ReadUint16(chunk + 2);
+    if (chunk_len < 4 || offset + chunk_len > len) {
+      return;
+    }
+    if ((chunk[0] == SCTP_CHUNK_DATA || chunk[0] == SCTP_CHUNK_IDATA) && chunk_len >= 8) {
+      uint32_t tsn = ReadUint32(chunk + 4);
+      if (tsn_sent && (int32_t)(tsn - highest_tsn_sent) <= 0) {
+        size_t header_len = chunk[0] == SCTP_CHUNK_DATA ? SCTP_DATA_HEADER_LEN : SCTP_IDATA_HEADER_LEN;
+        retransmitted_chunks.fetch_add(1, std::memory_order_relaxed);
+        retransmitted_bytes.fetch_add(chunk_len > header_len ? chunk_len - header_len : 0, std::memory_order_relaxed);
+      } else {
+        highest_tsn_sent = tsn;
+        tsn_sent = true;
+      }
+    }
+    offset += (chunk_len + 3) & ~(size_t)3;
+  }
+}
+
+// Common header, then a HEARTBEAT chunk whose info (nonce, probe size) the peer echoes back
+#define SCTP_PROBE_HEARTBEAT_OFFSET 12
+#define SCTP_PROBE_HEARTBEAT_LEN 16
+#define SCTP_PROBE_PAD_OFFSET (SCTP_PROBE_HEARTBEAT_OFFSET + SCTP_PROBE_HEARTBEAT_LEN)
+
+void SCTPWrapper::SendProbe() {
+  // The nonce keeps a forged or stale HEARTBEAT-ACK from confirming a size that never got through
+  uint32_t nonce;
+  if (RAND_bytes(reinterpret_cast<unsigned char *>(&nonce), sizeof(nonce)) != 1) {
+    // Without an unpredictable nonce the search is not trustworthy, keep the confirmed path_mtu
+    probe_size = 0;
+    probe_max_mtu = 0;
+    return;
+  }
+  probe_nonce = nonce;
+
+  // The probe must make a DTLS record of exactly probe_size bytes, SCTP packets are padded to 4 bytes
+  size_t len = (probe_size - record_overhead) & ~(size_t)3;
+  ChunkPtr probe = std::make_shared<Chunk>(len);
+  uint8_t *p = probe->Data();
+  memset(p, 0, len);
+
+  WriteUint16(p, local_port);
+  WriteUint16(p + 2, remote_port);
+  uint32_t vtag = peer_vtag;
+  memcpy(p + 4, &vtag, sizeof(vtag));
+
+  uint8_t *heartbeat = p + SCTP_PROBE_HEARTBEAT_OFFSET;
+  heartbeat[0] = SCTP_CHUNK_HEARTBEAT;
+  WriteUint16(heartbeat + 2, SCTP_PROBE_HEARTBEAT_LEN);
+  WriteUint16(heartbeat + 4, SCTP_PARAM_HEARTBEAT_INFO);
+  WriteUint16(heartbeat + 6, SCTP_PROBE_HEARTBEAT_LEN - 4);
+  WriteUint32(heartbeat + 8, probe_nonce);
+  WriteUint32(heartbeat + 12, probe_size);
+
+  // Receivers skip the PAD chunk (RFC 4820), it only makes the packet big
+  uint8_t *pad = p + SCTP_PROBE_PAD_OFFSET;
+  pad[0] = SCTP_CHUNK_PAD;
+  WriteUint16(pad + 2, (uint16_t)(len - SCTP_PROBE_PAD_OFFSET));
+
+  // The checksum goes on the wire least significant byte first
+  uint32_t crc = Crc32c(p, len);
+  p[8] = (uint8_t)crc;
+  p[9] = (uint8_t)(crc >> 8);
+  p[10] = (uint8_t)(crc >> 16);
+  p[11] = (uint8_t)(crc >> 24);
+
+  probe_attempts++;
+  probe_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SCTP_PROBE_TIMEOUT_MS);
+  this->dtlsEncryptCallback(probe);
+}
+
+// Search between the confirmed path_mtu and probe_high, trying the configured maximum first
+void SCTPWrapper::NextProbe() {
+  if (probe_high - path_mtu <= SCTP_PROBE_GRANULARITY) {
+    // Done, the path is not probed again
+    probe_size = 0;
+    probe_max_mtu = 0;
+    return;
+  }
+
+  probe_size = probe_high > probe_max_mtu ? probe_max_mtu : (uint16_t)((path_mtu + probe_high) / 2);
+  probe_attempts = 0;
+  SendProbe();
+}
+
+void SCTPWrapper::OnProbeTimeout() {
+  if (probe_attempts < SCTP_PROBE_MAX_ATTEMPTS) {
+    SendProbe();
+    return;
+  }
+
+  // Lost every time, assume it is too big
+  probe_high = probe_size;
+  NextProbe();
+}
+
+bool SCTPWrapper::IsProbeAck(const uint8_t *packet, size_t len) {
+  size_t offset = SCTP_COMMON_HEADER_LEN;
+  while (offset + 4 <= len) {
+    const uint8_t *chunk = packet + offset;
+    uint16_t chunk_len = ReadUint16(chunk + 2);
+    if (chunk_len < 4) {
+      return false;
+    }
+    if (chunk[0] == SCTP_CHUNK_HEARTBEAT_ACK && chunk_len >= SCTP_PROBE_HEARTBEAT_LEN && offset + SCTP_PROBE_HEARTBEAT_LEN <= len &&
+        ReadUint16(chunk + 4) == SCTP_PARAM_HEARTBEAT_INFO && ReadUint32(chunk + 8) == probe_nonce && ReadUint32(chunk + 12) == probe_size) {
+      return true;
+    }
+    offset += (chunk_len + 3) & ~3;
+  }
+  return false;
+}
+
+void SCTPWrapper::DTLSForSCTP(const std::vector<ChunkPtr> &chunks) { this->recv_queue.push_all(chunks); }
 
 uint16_t SCTPWrapper::GetSid(){
     return this->sid;
@@ -390,125 +937,279 @@ void SCTPWrapper::SetDataChannelSID(uint16_t sid)
   {
     this->sid = sid;
   }
-void SCTPWrapper::SendACK(uint8_t chan_type, uint32_t reliability) {
-    struct sctp_sndinfo sinfo = {0}; //
-    if (chan_type == DATA_CHANNEL_RELIABLE_UNORDERED ||
-        DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT_UNORDERED ||
-        DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED)
-    {
-      sinfo.snd_flags |= SCTP_UNORDERED;
-    }
-    if (chan_type == DATA_CHANNEL_PARTIAL_RELIABLE_TIMED ||
-        DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED) {
-      struct sctp_rtoinfo rinfo = {0};
-      rinfo.srto_initial = reliability;
-      rinfo.srto_max = reliability;
-      rinfo.srto_min = reliability;
-      if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_RTOINFO, &rinfo, sizeof(rinfo)) < 0) {
-		//std::cerr << "Error setting retransmission timeout on socket\n";
-	  }
-    }
-    if (chan_type == DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT_UNORDERED
-        || DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT) {
-      this->reliability = reliability;
-    }
-    sinfo.snd_sid = GetSid();
-    sinfo.snd_ppid = htonl(PPID_CONTROL); 
+// DataChannel control messages always go ordered and reliable, whatever the channel's type
+void SCTPWrapper::SendACK(uint16_t sid) {
+    struct sctp_sndinfo sinfo = {0};
+    sinfo.snd_sid = sid;
+    sinfo.snd_flags = SCTP_EOR;
+    sinfo.snd_ppid = htonl(PPID_CONTROL);
     uint8_t payload = DC_TYPE_ACK;
     if (usrsctp_sendv(this->sock, &payload, sizeof(uint8_t), NULL, 0, &sinfo, sizeof(sinfo), SCTP_SENDV_SNDINFO, 0) < 0) {
       throw std::runtime_error("Sending ACK failed");
 	}
-    if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_DEFAULT_SNDINFO, &sinfo, sizeof(sinfo)) < 0) {
-	  //std::cerr << "Setting Default SNDINFO failed\n";
-	}
 }
-void SCTPWrapper::CreateDCForSCTP(std::string label, std::string protocol, uint8_t chan_type, uint32_t reliability) {
+void SCTPWrapper::CreateDCForSCTP(uint16_t sid, std::string label, std::string protocol, uint8_t chan_type, uint32_t reliability,
+                                  uint16_t priority, std::function<void(const std::string &error)> on_failed) {
+  std::lock_guard<std::mutex> lock(open_mutex);
+  if (should_stop) {
+    return;
+  }
+  open_requests.push_back([this, sid, label, protocol, chan_type, reliability, priority, on_failed]() {
+    std::string error;
+    if (!OpenDataChannel(sid, label, protocol, chan_type, reliability, priority, error) && !should_stop && on_failed) {
+      on_failed(error);
+    }
+  });
+  if (!this->open_thread.joinable()) {
+    this->open_thread = std::thread(&SCTPWrapper::RunOpen, this);
+  }
+  open_cv.notify_one();
+}
+
+void SCTPWrapper::RunOpen() {
+  std::unique_lock<std::mutex> lock(open_mutex);
+  while (true) {
+    open_cv.wait(lock, [this] { return should_stop || !open_requests.empty(); });
+    if (should_stop) {
+      return;
+    }
+    std::function<void()> request = std::move(open_requests.front());
+    open_requests.pop_front();
+    lock.unlock();
+    request();
+    lock.lock();
+  }
+}
 
+bool SCTPWrapper::OpenDataChannel(uint16_t sid, const std::string &label, const std::string &protocol, uint8_t chan_type, uint32_t reliability,
+                                  uint16_t priority, std::string &error) {
   std::unique_lock<std::mutex> l2(createDCMtx);
-  while (!this->readyDataChannel) {
+  while (!this->readyDataChannel && !should_stop) {
     createDC.wait(l2);
   }
+  if (should_stop) {
+    error = "SCTP stopped";
+    return false;
+  }
   struct sctp_sndinfo sinfo = {0};
-  int sid;
-  sid = this->sid;
   sinfo.snd_sid = sid;
+  sinfo.snd_flags = SCTP_EOR;
   sinfo.snd_ppid = htonl(PPID_CONTROL);
-  if (chan_type == DATA_CHANNEL_RELIABLE_UNORDERED || DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED
-      || DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT_UNORDERED) {
-    sinfo.snd_flags |= SCTP_UNORDERED;
-  }
-  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_DEFAULT_SNDINFO, &sinfo, sizeof(sinfo)) < 0) {
-	//std::cerr << "Setting default SNDINFO failed\n";
-  }
-  if (chan_type == DATA_CHANNEL_PARTIAL_RELIABLE_TIMED ||
-      DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED) {
-    struct sctp_rtoinfo rinfo = {0};
-    rinfo.srto_initial = reliability;
-    rinfo.srto_max = reliability;
-    rinfo.srto_min = reliability;
-    if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_RTOINFO, &rinfo, sizeof(rinfo)) < 0) {
-	  //std::cerr << "Error setting retransmission timeout on socket\n";
-	}
-  }
 
-  if (chan_type == DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT_UNORDERED ||
-      DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT) {
-    this->reliability = reliability;
+  if (!EnsureStream(sid)) {
+    error = "The peer did not add a stream for the data channel";
+    return false;
   }
 
+  SetStreamPriority(sid, priority);
+
   int total_size = sizeof *this->data + label.size() + protocol.size() - (2 * sizeof(char *));
+  free(this->data);
   this->data = (dc_open_msg *)calloc(1, total_size);
   this->data->msg_type = DC_TYPE_OPEN;
   this->data->chan_type = chan_type;
-  this->data->priority = htons(0); // https://tools.ietf.org/html/draft-ietf-rtcweb-data-channel-10#section-6.4
+  this->data->priority = htons(priority); // https://tools.ietf.org/html/draft-ietf-rtcweb-data-channel-10#section-6.4
   this->data->reliability = htonl(reliability);
   this->data->label_len = htons(label.length());
   this->data->protocol_len = htons(protocol.length());
-  // try to overwrite last two char* from the struct
-  memcpy(&this->data->label, label.c_str(), label.length());
-  memcpy(&this->data->label + label.length(), protocol.c_str(), protocol.length());
+  // overwrite last two char* from the struct with label followed by protocol
+  char *label_ptr = reinterpret_cast<char *>(&this->data->label);
+  memcpy(label_ptr, label.c_str(), label.length());
+  memcpy(label_ptr + label.length(), protocol.c_str(), protocol.length());
 
   this->label = label.c_str();
   this->protocol = protocol.c_str();
 
   if (started) {
     if (usrsctp_sendv(this->sock, this->data, total_size, NULL, 0, &sinfo, sizeof(sinfo), SCTP_SENDV_SNDINFO, 0) < 0) {
-	  //std::cerr << "Failed to send a datachannel open request\n";
-	}
+      error = "Failed to send the data channel open request";
+      return false;
+    }
   }
+  return true;
 }
+bool SCTPWrapper::EnsureStream(uint16_t sid) {
+  std::unique_lock<std::mutex> lock(streams_mutex);
+  while (sid >= outbound_streams || sid >= inbound_streams) {
+    if (sid >= config.max_streams || should_stop) {
+      return false;
+    }
+
+    if (!streams_change_pending) {
+      // Grow at least geometrically, so a burst of new channels costs few round trips
+      uint32_t wanted = std::max<uint32_t>(sid + 1, 2 * (uint32_t)std::max(outbound_streams, inbound_streams));
+      wanted = std::min<uint32_t>(wanted, config.max_streams);
+
+      struct sctp_add_streams add;
+      memset(&add, 0, sizeof(add));
+      add.sas_assoc_id = 0;
+      add.sas_outstrms = wanted > outbound_streams ? (uint16_t)(wanted - outbound_streams) : 0;
+      add.sas_instrms = wanted > inbound_streams ? (uint16_t)(wanted - inbound_streams) : 0;
+      streams_requested_out = std::max<uint16_t>(outbound_streams, (uint16_t)wanted);
+      streams_requested_in = std::max<uint16_t>(inbound_streams, (uint16_t)wanted);
+      streams_change_pending = true;
+      streams_change_failed = false;
+
+      // usrsctp may report the outcome from within setsockopt
+      lock.unlock();
+      int result = usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_ADD_STREAMS, &add, sizeof(add));
+      lock.lock();
+      if (result == -1) {
+		//std::cerr << "Could not set socket options for SCTP_ADD_STREAMS. errno= " << errno << '\n';
+        streams_change_pending = false;
+        return false;
+      }
+    }
+
+    if (!streams_cv.wait_for(lock, std::chrono::seconds(5), [this] { return !streams_change_pending || should_stop; })) {
+      streams_change_pending = false;  // let a later call ask again
+      return false;
+    }
+    if (streams_change_failed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void SCTPWrapper::SetStreamPriority(uint16_t sid, uint16_t priority) {
+  // Only the priority scheduler has per-stream values, it serves the lowest value first
+  if (config.scheduler != SctpStreamScheduler::Priority) {
+    return;
+  }
+
+  struct sctp_stream_value value;
+  memset(&value, 0, sizeof(value));
+  value.assoc_id = 0;
+  value.stream_id = sid;
+  value.stream_value = UINT16_MAX - priority;
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_SS_VALUE, &value, sizeof(value)) == -1) {
+	//std::cerr << "Could not set socket options for SCTP_SS_VALUE. errno= " << errno << '\n';
+  }
+}
+
 // Send a message to the remote connection
-void SCTPWrapper::GSForSCTP(ChunkPtr chunk, uint16_t sid, uint32_t ppid) {
+void SCTPWrapper::GSForSCTP(ChunkPtr chunk, uint16_t sid, uint32_t ppid, uint8_t chan_type, uint32_t reliability, bool is_last,
+                            bool bundled) {
   shouldSend = true;
 
+  SendResult result;
+  {
+    std::lock_guard<std::mutex> lock(bundle_mutex);
+    if (config.bundling && bundled && is_last) {
+      // Each message costs a DATA chunk header and padding on top of its payload
+      size_t cost = SCTP_DATA_HEADER_LEN + ((chunk->Length() + 3) & ~(size_t)3);
+      size_t packet = path_mtu > record_overhead + SCTP_COMMON_HEADER_LEN ? path_mtu - record_overhead - SCTP_COMMON_HEADER_LEN : 0;
+      if (held_bytes + cost < packet) {
+        held.push_back(HeldMessage{chunk, sid, ppid, chan_type, reliability});
+        held_bytes += cost;
+        if (held.size() == 1) {
+          ScheduleFlush();
+        }
+        return;
+      }
+      // This one fills the packet, it leaves together with what is held
+      held.push_back(HeldMessage{chunk, sid, ppid, chan_type, reliability});
+      SendHeld();
+      return;
+    }
+    // Unbundled messages and pieces of large ones go out at once, after what is held
+    // so the order on each stream stays as sent
+    SendHeld();
+    result = SendNow(chunk, sid, ppid, chan_type, reliability, is_last);
+  }
+  if (result == SendCancelled) {
+    throw std::runtime_error("Send cancelled");
+  } else if (result == SendFailed) {
+    throw std::runtime_error("Send failed");
+  }
+}
+
+SCTPWrapper::SendResult SCTPWrapper::SendNow(ChunkPtr chunk, uint16_t sid, uint32_t ppid, uint8_t chan_type, uint32_t reliability, bool is_last) {
   struct sctp_sendv_spa spa = {0};
 
-  // spa.sendv_flags = SCTP_SEND_SNDINFO_VALID | SCTP_SEND_PRINFO_VALID;
-  spa.sendv_flags = SCTP_SEND_SNDINFO_VALID;
+  spa.sendv_flags = SCTP_SEND_SNDINFO_VALID | SCTP_SEND_PRINFO_VALID;
 
   spa.sendv_sndinfo.snd_sid = sid;
   spa.sendv_sndinfo.snd_context = 0;
   spa.sendv_sndinfo.snd_assoc_id = 0;
   spa.sendv_sndinfo.snd_ppid = htonl(ppid);
-  spa.sendv_sndinfo.snd_flags |= SCTP_EOR;
+  if (is_last) {
+    spa.sendv_sndinfo.snd_flags |= SCTP_EOR;
+  }
+
+  // The high bit of every unordered channel type is set, see DataChannel.hpp
+  if (chan_type & DATA_CHANNEL_RELIABLE_UNORDERED) {
+    spa.sendv_sndinfo.snd_flags |= SCTP_UNORDERED;
+  }
+
+  // Partial reliability is per message, so lossy channels drop stale data without touching the other streams
+  switch (chan_type) {
+    case DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT:
+    case DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT_UNORDERED:
+      spa.sendv_prinfo.pr_policy = SCTP_PR_SCTP_RTX;
+      spa.sendv_prinfo.pr_value = reliability;
+      break;
+    case DATA_CHANNEL_PARTIAL_RELIABLE_TIMED:
+    case DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED:
+      spa.sendv_prinfo.pr_policy = SCTP_PR_SCTP_TTL;
+      spa.sendv_prinfo.pr_value = reliability;
+      break;
+    default:
+      spa.sendv_prinfo.pr_policy = SCTP_PR_SCTP_NONE;
+      spa.sendv_prinfo.pr_value = 0;
+      break;
+  }
 
   int tries = 0;
-  // "Resource temporarily unavaliable" occurs without a timeout. this->reliability is always 0
-//  while (tries <= this->reliability) {
+  bool would_block = false;
+  // "Resource temporarily unavaliable" occurs without a timeout
+  size_t offset = 0;
   while (tries < 3000 && shouldSend) {
-      if (usrsctp_sendv(this->sock, chunk->Data(), chunk->Length(), NULL, 0, &spa, sizeof(spa), SCTP_SENDV_SPA, 0) < 0) {
+      // With explicit EOR usrsctp may take only part of the data, the rest continues the same message
+      ssize_t sent = usrsctp_sendv(this->sock, chunk->Data() + offset, chunk->Length() - offset, NULL, 0, &spa, sizeof(spa), SCTP_SENDV_SPA, 0);
+      if (sent < 0) {
           //logger->error("FAILED to send, trying again in {} ms. Retry count: {}", tries, tries);
+          if (!would_block && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+              would_block = true;
+              sends_would_block.fetch_add(1, std::memory_order_relaxed);
+          }
+          send_retries.fetch_add(1, std::memory_order_relaxed);
           std::this_thread::sleep_for(std::chrono::milliseconds(1));
           tries += 1;
       } else {
-          return;
+          offset += sent;
+          if (offset >= chunk->Length()) {
+              return SendOk;
+          }
       }
   }
-  if(!shouldSend) {
-      throw std::runtime_error("Send cancelled");
+  sends_failed.fetch_add(1, std::memory_order_relaxed);
+  return shouldSend ? SendFailed : SendCancelled;
+}
+
+void SCTPWrapper::SendHeld() {
+  if (held.empty()) {
+    return;
+  }
+  std::vector<HeldMessage> batch;
+  batch.swap(held);
+  held_bytes = 0;
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    flush_pending = false;
   }
-  else {
-    throw std::runtime_error("Send failed");
+
+  // usrsctp bundles whatever it has queued when it builds a packet. With Nagle on, it queues each message
+  // while earlier data is in flight, then the last send, with Nagle off, sends everything queued at once.
+  // Failures here only show in the stats, the callers of GSForSCTP have already returned.
+  for (size_t i = 0; i < batch.size(); i++) {
+    const HeldMessage &message = batch[i];
+    SetNoDelay(i + 1 == batch.size());
+    if (SendNow(message.chunk, message.sid, message.ppid, message.chan_type, message.reliability, true) == SendCancelled) {
+      SetNoDelay(true);
+      return;
+    }
   }
 }
 
@@ -517,6 +1218,55 @@ void SCTPWrapper::StopSend()
     shouldSend = false;
 }
 
+void SCTPWrapper::ScheduleFlush() {
+  std::lock_guard<std::mutex> lock(flush_mutex);
+  if (!flush_pending) {
+    flush_pending = true;
+    flush_deadline = std::chrono::steady_clock::now() + config.bundling_max_delay;
+    flush_cv.notify_one();
+  }
+}
+
+void SCTPWrapper::RunFlush() {
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  while (!this->should_stop) {
+    if (!flush_pending) {
+      flush_cv.wait(lock);
+    } else if (std::chrono::steady_clock::now() < flush_deadline) {
+      flush_cv.wait_until(lock, flush_deadline);
+    } else {
+      lock.unlock();
+      Flush();
+      lock.lock();
+    }
+  }
+}
+
+void SCTPWrapper::Flush() {
+  if (!config.bundling) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(bundle_mutex);
+  SendHeld();
+  {
+    std::lock_guard<std::mutex> flush_lock(flush_mutex);
+    flush_pending = false;
+  }
+}
+
+bool SCTPWrapper::SetNoDelay(bool nodelay) {
+  if (!this->sock || this->nodelay == nodelay) {
+    return true;
+  }
+  uint32_t value = nodelay ? 1 : 0;
+  if (usrsctp_setsockopt(this->sock, IPPROTO_SCTP, SCTP_NODELAY, &value, sizeof(value)) == -1) {
+	//std::cerr << "Could not set socket options for SCTP_NODELAY. errno= " << errno << '\n';
+    return false;
+  }
+  this->nodelay = nodelay;
+  return true;
+}
+
 void SCTPWrapper::RecvLoop() {
   // Util::SetThreadName("SCTP-RecvLoop");
 //  NDC ndc("SCTP-RecvLoop");
@@ -529,13 +1279,49 @@ void SCTPWrapper::RecvLoop() {
     }
   }
 
+  std::vector<ChunkPtr> chunks;
   while (!this->should_stop) {
-    ChunkPtr chunk = this->recv_queue.wait_and_pop();
-    if (!chunk) {
-      return;
+    if (probe_max_mtu && !probe_size && assoc_up && peer_vtag) {
+      NextProbe();
+    }
+
+    ChunkPtr chunk;
+    if (probe_size) {
+      auto now = std::chrono::steady_clock::now();
+      chunk = now < probe_deadline ? this->recv_queue.wait_and_pop_for(probe_deadline - now) : ChunkPtr();
+      if (!chunk) {
+        if (this->should_stop) {
+          return;
+        }
+        OnProbeTimeout();
+        continue;
+      }
+    } else {
+      chunk = this->recv_queue.wait_and_pop();
+      if (!chunk) {
+        return;
+      }
+    }
+
+    // Feed everything that is queued to usrsctp back to back
+    chunks.clear();
+    chunks.push_back(chunk);
+    this->recv_queue.pop_all(chunks);
+    for (auto &packet : chunks) {
+      if (probe_size && IsProbeAck(packet->Data(), packet->Length())) {
+        // usrsctp drops the unknown HEARTBEAT ACK, the rest of the packet still matters
+        path_mtu = probe_size;
+        ApplyPathMtu();
+        if (this->path_mtu_callback) {
+          this->path_mtu_callback(probe_size);
+        }
+        NextProbe();
+      }
+      //SPDLOG_DEBUG(logger, "RunRecv() Handling packet of len - {}", packet->Length());
+      packets_received.fetch_add(1, std::memory_order_relaxed);
+      bytes_received.fetch_add(packet->Length(), std::memory_order_relaxed);
+      usrsctp_conninput(this, packet->Data(), packet->Length(), 0);
     }
-    //SPDLOG_DEBUG(logger, "RunRecv() Handling packet of len - {}", chunk->Length());
-    usrsctp_conninput(this, chunk->Data(), chunk->Length(), 0);
   }
 }
 
@@ -0,0 +1,529 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * UDP sockets shared by many PeerConnections.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "UdpMux.hpp"
+
+namespace rtcdcpp {
+
+// STUN (RFC 5389) as far as answering ICE connectivity checks needs it
+#define STUN_HEADER_SIZE 20
+#define STUN_MAGIC_COOKIE 0x2112A442
+#define STUN_BINDING_REQUEST 0x0001
+#define STUN_BINDING_SUCCESS 0x0101
+#define STUN_ATTR_USERNAME 0x0006
+#define STUN_ATTR_MESSAGE_INTEGRITY 0x0008
+#define STUN_ATTR_XOR_MAPPED_ADDRESS 0x0020
+#define STUN_ATTR_USE_CANDIDATE 0x0025
+#define STUN_ATTR_FINGERPRINT 0x8028
+#define STUN_FINGERPRINT_XOR 0x5354554e
+#define STUN_HMAC_SIZE 20
+
+static uint16_t Read16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t Read32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static void Write16(uint8_t *p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+}
+static void Write32(uint8_t *p, uint32_t value) {
+  Write16(p, value >> 16);
+  Write16(p + 2, value & 0xffff);
+}
+
+// CRC-32 as used by the STUN FINGERPRINT attribute
+static uint32_t Crc32(const uint8_t *data, size_t len) {
+  static const std::vector<uint32_t> table = [] {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+static bool IsStun(const uint8_t *msg, size_t len) {
+  return len >= STUN_HEADER_SIZE && (msg[0] & 0xC0) == 0 && Read32(msg + 4) == STUN_MAGIC_COOKIE && (size_t)Read16(msg + 2) + STUN_HEADER_SIZE == len &&
+         (len & 3) == 0;
+}
+
+// ICE credentials from the ice-char alphabet
+static std::string RandomIceString(size_t len) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::vector<unsigned char> random(len);
+  if (RAND_bytes(random.data(), (int)len) != 1) {
+    throw std::runtime_error("Could not generate ICE credentials");
+  }
+  std::string result;
+  for (unsigned char byte : random) {
+    result.push_back(alphabet[byte & 63]);
+  }
+  return result;
+}
+
+size_t UdpMux::AddressHash::operator()(const AddressKey &key) const {
+  // FNV-1a
+  size_t hash = 14695981039346656037ULL;
+  for (uint8_t i = 0; i < key.len; i++) {
+    hash = (hash ^ key.bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool UdpMux::MakeKey(const struct sockaddr_storage &address, AddressKey &key) {
+  if (address.ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)&address;
+    memcpy(key.bytes, &sin->sin_port, 2);
+    memcpy(key.bytes + 2, &sin->sin_addr, 4);
+    key.len = 6;
+    return true;
+  }
+  if (address.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&address;
+    memcpy(key.bytes, &sin6->sin6_port, 2);
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+      memcpy(key.bytes + 2, sin6->sin6_addr.s6_addr + 12, 4);
+      key.len = 6;
+    } else {
+      memcpy(key.bytes + 2, &sin6->sin6_addr, 16);
+      key.len = 18;
+    }
+    return true;
+  }
+  return false;
+}
+
+UdpMux::UdpMux(const std::string &address, uint16_t port, size_t sockets, const std::string &public_address)
+    : public_address(public_address.empty() ? address : public_address), port(port), pool(UDP_MUX_BUFFER_SIZE, 4 * UDP_MUX_BATCH_SIZE) {
+  struct sockaddr_storage bind_address;
+  memset(&bind_address, 0, sizeof(bind_address));
+  socklen_t bind_len;
+  struct sockaddr_in *sin = (struct sockaddr_in *)&bind_address;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&bind_address;
+  if (inet_pton(AF_INET, address.c_str(), &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    bind_len = sizeof(struct sockaddr_in);
+  } else if (inet_pton(AF_INET6, address.c_str(), &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    bind_len = sizeof(struct sockaddr_in6);
+  } else {
+    throw std::invalid_argument("UdpMux needs a numeric address");
+  }
+
+  if (sockets == 0) {
+    sockets = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (size_t i = 0; i < sockets; i++) {
+    // Port zero is resolved by the first bind, the others share whatever it got
+    if (bind_address.ss_family == AF_INET) {
+      sin->sin_port = htons(this->port);
+    } else {
+      sin6->sin6_port = htons(this->port);
+    }
+
+    int fd = socket(bind_address.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+      break;
+    }
+    int on = 1;
+    int off = 0;
+    int buffer = UDP_MUX_SOCKET_BUFFER;
+    struct timeval timeout = {0, 200 * 1000};  // lets readers notice stopping
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (bind_address.ss_family == AF_INET6) {
+      // Also take IPv4 remotes when bound to ::
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+    if (bind(fd, (struct sockaddr *)&bind_address, bind_len) < 0) {
+      //std::cerr << "UdpMux: bind failed. errno= " << errno << '\n';
+      close(fd);
+      break;
+    }
+    if (this->port == 0) {
+      struct sockaddr_storage bound;
+      socklen_t bound_len = sizeof(bound);
+      getsockname(fd, (struct sockaddr *)&bound, &bound_len);
+      this->port = ntohs(bound.ss_family == AF_INET ? ((struct sockaddr_in *)&bound)->sin_port : ((struct sockaddr_in6 *)&bound)->sin6_port);
+    }
+    fds.push_back(fd);
+  }
+
+  if (fds.size() < sockets) {
+    for (int fd : fds) {
+      close(fd);
+    }
+    throw std::runtime_error("UdpMux could not bind its sockets");
+  }
+
+  for (int fd : fds) {
+    readers.emplace_back(&UdpMux::RunReader, this, fd);
+  }
+}
+
+UdpMux::~UdpMux() {
+  stopping = true;
+  for (auto &reader : readers) {
+    if (reader.joinable()) {
+      reader.join();
+    }
+  }
+  for (int fd : fds) {
+    close(fd);
+  }
+}
+
+std::string UdpMux::CandidateSdp() const {
+  return "candidate:1 1 udp 2130706431 " + public_address + " " + std::to_string(port) + " typ host";
+}
+
+std::shared_ptr<UdpMux::Peer> UdpMux::Register(std::function<void()> on_ready, std::function<void(ChunkPtr)> on_data) {
+  auto peer = std::make_shared<Peer>();
+  peer->pwd = RandomIceString(24);
+  peer->on_ready = std::move(on_ready);
+  peer->on_data = std::move(on_data);
+
+  std::lock_guard<std::mutex> lock(mut);
+  do {
+    peer->ufrag = RandomIceString(8);
+  } while (by_ufrag.count(peer->ufrag) > 0);
+  by_ufrag[peer->ufrag] = peer;
+  return peer;
+}
+
+void UdpMux::Unregister(const std::shared_ptr<Peer> &peer) {
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    by_ufrag.erase(peer->ufrag);
+    std::lock_guard<std::mutex> address_lock(peer->address_mutex);
+    AddressKey key;
+    if (peer->remote_len > 0 && MakeKey(peer->remote, key)) {
+      auto it = by_address.find(key);
+      if (it != by_address.end() && it->second == peer) {
+        by_address.erase(it);
+      }
+    }
+  }
+
+  // Wait out a running callback
+  std::lock_guard<std::mutex> lock(peer->callback_mutex);
+  peer->active = false;
+}
+
+std::shared_ptr<UdpMux::Peer> UdpMux::FindByUfrag(const std::string &ufrag) {
+  std::lock_guard<std::mutex> lock(mut);
+  auto it = by_ufrag.find(ufrag);
+  return it != by_ufrag.end() ? it->second : nullptr;
+}
+
+std::shared_ptr<UdpMux::Peer> UdpMux::FindByAddress(const struct sockaddr_storage &from) {
+  AddressKey key;
+  if (!MakeKey(from, key)) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mut);
+  auto it = by_address.find(key);
+  return it != by_address.end() ? it->second : nullptr;
+}
+
+int UdpMux::Send(Peer &peer, const ChunkPtr *chunks, size_t count) {
+  struct sockaddr_storage remote;
+  socklen_t remote_len;
+  int fd;
+  {
+    std::lock_guard<std::mutex> lock(peer.address_mutex);
+    remote = peer.remote;
+    remote_len = peer.remote_len;
+    fd = peer.fd;
+  }
+  if (remote_len == 0) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  size_t sent = 0;
+#ifdef __linux__
+  struct mmsghdr msgs[UDP_MUX_BATCH_SIZE];
+  struct iovec iovs[UDP_MUX_BATCH_SIZE];
+  while (sent < count) {
+    size_t batch = std::min(count - sent, (size_t)UDP_MUX_BATCH_SIZE);
+    for (size_t i = 0; i < batch; i++) {
+      iovs[i].iov_base = chunks[sent + i]->Data();
+      iovs[i].iov_len = chunks[sent + i]->Length();
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &remote;
+      msgs[i].msg_hdr.msg_namelen = remote_len;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int result = sendmmsg(fd, msgs, batch, 0);
+    if (result <= 0) {
+      return sent > 0 ? (int)sent : -1;
+    }
+    sent += result;
+  }
+#else
+  for (; sent < count; sent++) {
+    if (sendto(fd, chunks[sent]->Data(), chunks[sent]->Length(), 0, (struct sockaddr *)&remote, remote_len) < 0) {
+      return sent > 0 ? (int)sent : -1;
+    }
+  }
+#endif
+  return (int)sent;
+}
+
+void UdpMux::RunReader(int fd) {
+  ChunkPtr buffers[UDP_MUX_BATCH_SIZE];
+  struct sockaddr_storage addresses[UDP_MUX_BATCH_SIZE];
+#ifdef __linux__
+  // Block for one datagram, then take whatever else is already waiting
+  struct mmsghdr msgs[UDP_MUX_BATCH_SIZE];
+  struct iovec iovs[UDP_MUX_BATCH_SIZE];
+  while (!stopping) {
+    for (size_t i = 0; i < UDP_MUX_BATCH_SIZE; i++) {
+      if (!buffers[i]) {
+        buffers[i] = pool.Get(UDP_MUX_BUFFER_SIZE);
+      }
+      iovs[i].iov_base = buffers[i]->Data();
+      iovs[i].iov_len = buffers[i]->Capacity();
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &addresses[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg(fd, msgs, UDP_MUX_BATCH_SIZE, MSG_WAITFORONE, nullptr);
+    for (int i = 0; i < count; i++) {
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        // Cut short, the buffer is reused
+        continue;
+      }
+      buffers[i]->Resize(msgs[i].msg_len);
+      OnDatagram(fd, std::move(buffers[i]), addresses[i], msgs[i].msg_hdr.msg_namelen);
+    }
+  }
+#else
+  while (!stopping) {
+    if (!buffers[0]) {
+      buffers[0] = pool.Get(UDP_MUX_BUFFER_SIZE);
+    }
+    struct iovec iov;
+    iov.iov_base = buffers[0]->Data();
+    iov.iov_len = buffers[0]->Capacity();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addresses[0];
+    msg.msg_namelen = sizeof(addresses[0]);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t len = recvmsg(fd, &msg, 0);
+    if (len > 0 && !(msg.msg_flags & MSG_TRUNC)) {
+      buffers[0]->Resize(len);
+      OnDatagram(fd, std::move(buffers[0]), addresses[0], msg.msg_namelen);
+    }
+  }
+#endif
+}
+
+void UdpMux::OnDatagram(int fd, ChunkPtr datagram, const struct sockaddr_storage &from, socklen_t from_len) {
+  if (IsStun(datagram->Data(), datagram->Length())) {
+    if (Read16(datagram->Data()) == STUN_BINDING_REQUEST) {
+      OnBindingRequest(fd, datagram->Data(), datagram->Length(), from, from_len);
+    }
+    return;
+  }
+
+  auto peer = FindByAddress(from);
+  if (!peer) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(peer->callback_mutex);
+  if (peer->active) {
+    peer->on_data(datagram);
+  }
+}
+
+void UdpMux::OnBindingRequest(int fd, const uint8_t *msg, size_t len, const struct sockaddr_storage &from, socklen_t from_len) {
+  std::string username;
+  size_t integrity_offset = 0;
+  bool use_candidate = false;
+
+  // Attributes after MESSAGE-INTEGRITY are only FINGERPRINT, which it already covers
+  size_t offset = STUN_HEADER_SIZE;
+  while (offset + 4 <= len) {
+    uint16_t type = Read16(msg + offset);
+    uint16_t attr_len = Read16(msg + offset + 2);
+    const uint8_t *value = msg + offset + 4;
+    if (offset + 4 + attr_len > len) {
+      return;
+    }
+    if (type == STUN_ATTR_USERNAME) {
+      username.assign((const char *)value, attr_len);
+    } else if (type == STUN_ATTR_USE_CANDIDATE) {
+      use_candidate = true;
+    } else if (type == STUN_ATTR_MESSAGE_INTEGRITY) {
+      if (attr_len != STUN_HMAC_SIZE) {
+        return;
+      }
+      integrity_offset = offset;
+      break;
+    }
+    offset += 4 + ((attr_len + 3) & ~3);
+  }
+
+  // USERNAME is "local ufrag:remote ufrag", local being ours
+  size_t colon = username.find(':');
+  if (colon == std::string::npos || integrity_offset == 0) {
+    return;
+  }
+  auto peer = FindByUfrag(username.substr(0, colon));
+  if (!peer) {
+    return;
+  }
+
+  // The HMAC covers everything before MESSAGE-INTEGRITY, with the length field ending at it
+  uint8_t mac[EVP_MAX_MD_SIZE];
+  unsigned int mac_len = 0;
+  std::vector<uint8_t> signed_part(msg, msg + integrity_offset);
+  Write16(signed_part.data() + 2, integrity_offset + 4 + STUN_HMAC_SIZE - STUN_HEADER_SIZE);
+  HMAC(EVP_sha1(), peer->pwd.data(), (int)peer->pwd.size(), signed_part.data(), signed_part.size(), mac, &mac_len);
+  if (mac_len != STUN_HMAC_SIZE || CRYPTO_memcmp(mac, msg + integrity_offset + 4, STUN_HMAC_SIZE) != 0) {
+    return;
+  }
+
+  // Binding success: XOR-MAPPED-ADDRESS, MESSAGE-INTEGRITY and FINGERPRINT
+  uint8_t response[STUN_HEADER_SIZE + 24 + 4 + STUN_HMAC_SIZE + 8];
+  Write16(response, STUN_BINDING_SUCCESS);
+  Write32(response + 4, STUN_MAGIC_COOKIE);
+  memcpy(response + 8, msg + 8, 12);
+  size_t size = STUN_HEADER_SIZE;
+
+  uint8_t *mapped = response + size;
+  const uint8_t *address;
+  uint16_t mapped_port;
+  size_t address_len;
+  if (from.ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)&from;
+    address = (const uint8_t *)&sin->sin_addr;
+    address_len = 4;
+    mapped_port = ntohs(sin->sin_port);
+  } else {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&from;
+    bool v4_mapped = IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr);
+    address = sin6->sin6_addr.s6_addr + (v4_mapped ? 12 : 0);
+    address_len = v4_mapped ? 4 : 16;
+    mapped_port = ntohs(sin6->sin6_port);
+  }
+  Write16(mapped, STUN_ATTR_XOR_MAPPED_ADDRESS);
+  Write16(mapped + 2, 4 + address_len);
+  mapped[4] = 0;
+  mapped[5] = address_len == 4 ? 0x01 : 0x02;
+  Write16(mapped + 6, mapped_port ^ (STUN_MAGIC_COOKIE >> 16));
+  // XORed with the magic cookie followed by the transaction id
+  for (size_t i = 0; i < address_len; i++) {
+    mapped[8 + i] = address[i] ^ response[4 + i];
+  }
+  size += 8 + address_len;
+
+  Write16(response + size, STUN_ATTR_MESSAGE_INTEGRITY);
+  Write16(response + size + 2, STUN_HMAC_SIZE);
+  Write16(response + 2, size + 4 + STUN_HMAC_SIZE - STUN_HEADER_SIZE);
+  HMAC(EVP_sha1(), peer->pwd.data(), (int)peer->pwd.size(), response, size, response + size + 4, &mac_len);
+  size += 4 + STUN_HMAC_SIZE;
+
+  Write16(response + size, STUN_ATTR_FINGERPRINT);
+  Write16(response + size + 2, 4);
+  Write16(response + 2, size + 8 - STUN_HEADER_SIZE);
+  Write32(response + size + 4, Crc32(response, size) ^ STUN_FINGERPRINT_XOR);
+  size += 8;
+
+  sendto(fd, response, size, 0, (const struct sockaddr *)&from, from_len);
+
+  // The first valid check selects the address, a nomination may move it
+  AddressKey key;
+  if (!MakeKey(from, key)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    auto registered = by_ufrag.find(peer->ufrag);
+    if (registered == by_ufrag.end() || registered->second != peer) {
+      // Unregistered meanwhile
+      return;
+    }
+    std::lock_guard<std::mutex> address_lock(peer->address_mutex);
+    if (peer->remote_len == 0 || use_candidate) {
+      AddressKey old_key;
+      if (peer->remote_len > 0 && MakeKey(peer->remote, old_key) && !(old_key == key)) {
+        auto it = by_address.find(old_key);
+        if (it != by_address.end() && it->second == peer) {
+          by_address.erase(it);
+        }
+      }
+      peer->remote = from;
+      peer->remote_len = from_len;
+      peer->fd = fd;
+      by_address[key] = peer;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(peer->callback_mutex);
+  if (peer->active && !peer->ready) {
+    peer->ready = true;
+    peer->on_ready();
+  }
+}
+}
@@ -0,0 +1,326 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/**
+ * Loopback throughput benchmark: two PeerConnections in one process, with their ICE candidates
+ * rewritten to a UDP relay that delays every datagram, so the transfer runs over an emulated
+ * long-distance path. Times one bulk transfer per SCTP preset and prints the throughput.
+ * Exits non-zero only when a transfer does not complete.
+ *
+ * Usage: SctpThroughputBenchmark [one-way delay ms] [megabytes]
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "PeerConnection.hpp"
+
+using namespace rtcdcpp;
+
+#define BENCH_DEFAULT_DELAY_MS 25
+#define BENCH_DEFAULT_MEGABYTES 16
+#define BENCH_MESSAGE_SIZE (16 * 1024)
+#define BENCH_TIMEOUT_S 60
+#define RELAY_DATAGRAM_SIZE 2048
+
+// Two sockets on 127.0.0.1, one per peer. A datagram peer A sends to side 0 leaves side 1 for
+// peer B after the delay, and the other way round, so each peer sees the other at the relay.
+class DelayRelay {
+ public:
+  explicit DelayRelay(std::chrono::milliseconds delay) : delay(delay) {
+    for (int side = 0; side < 2; side++) {
+      sock[side] = socket(AF_INET, SOCK_DGRAM, 0);
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t len = sizeof(addr);
+      if (sock[side] < 0 || bind(sock[side], (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+          getsockname(sock[side], (struct sockaddr *)&addr, &len) != 0) {
+        throw std::runtime_error("Could not open the relay sockets");
+      }
+      port[side] = ntohs(addr.sin_port);
+      // Deep buffers, so the relay itself does not drop what the delay keeps in flight
+      int size = 8 * 1024 * 1024;
+      setsockopt(sock[side], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+      setsockopt(sock[side], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    thread = std::thread(&DelayRelay::Run, this);
+  }
+
+  ~DelayRelay() {
+    should_stop = true;
+    thread.join();
+    close(sock[0]);
+    close(sock[1]);
+  }
+
+  // Where the peer on side lives, datagrams for it are dropped until this is known
+  void SetPeer(int side, const std::string &ip, uint16_t peer_port) {
+    std::lock_guard<std::mutex> lock(mutex);
+    memset(&peer[side], 0, sizeof(peer[side]));
+    peer[side].sin_family = AF_INET;
+    inet_pton(AF_INET, ip.c_str(), &peer[side].sin_addr);
+    peer[side].sin_port = htons(peer_port);
+    peer_known[side] = true;
+  }
+
+  uint16_t Port(int side) const { return port[side]; }
+
+ private:
+  struct Datagram {
+    std::chrono::steady_clock::time_point due;
+    std::vector<uint8_t> data;
+  };
+
+  std::chrono::milliseconds delay;
+  int sock[2];
+  uint16_t port[2];
+  std::mutex mutex;
+  struct sockaddr_in peer[2];
+  bool peer_known[2]{false, false};
+  // Datagrams waiting to leave towards the peer on each side, in arrival order as the delay is fixed
+  std::deque<Datagram> queue[2];
+  std::atomic<bool> should_stop{false};
+  std::thread thread;
+
+  void Run() {
+    uint8_t buffer[RELAY_DATAGRAM_SIZE];
+    while (!should_stop) {
+      auto now = std::chrono::steady_clock::now();
+      int timeout = 10;
+      for (int side = 0; side < 2; side++) {
+        while (!queue[side].empty() && queue[side].front().due <= now) {
+          Datagram &datagram = queue[side].front();
+          std::lock_guard<std::mutex> lock(mutex);
+          if (peer_known[side]) {
+            sendto(sock[side], datagram.data.data(), datagram.data.size(), 0, (struct sockaddr *)&peer[side], sizeof(peer[side]));
+          }
+          queue[side].pop_front();
+        }
+        if (!queue[side].empty()) {
+          auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(queue[side].front().due - now).count();
+          timeout = std::min<int>(timeout, (int)wait + 1);
+        }
+      }
+
+      struct pollfd fds[2] = {{sock[0], POLLIN, 0}, {sock[1], POLLIN, 0}};
+      if (poll(fds, 2, timeout) <= 0) {
+        continue;
+      }
+      for (int side = 0; side < 2; side++) {
+        if (!(fds[side].revents & POLLIN)) {
+          continue;
+        }
+        ssize_t len;
+        while ((len = recv(sock[side], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+          queue[1 - side].push_back(Datagram{std::chrono::steady_clock::now() + delay, std::vector<uint8_t>(buffer, buffer + len)});
+        }
+      }
+    }
+  }
+};
+
+// Hands each peer's descriptions and candidates to the other, pointing the candidates at the relay
+class Signalling {
+ public:
+  Signalling(DelayRelay &relay) : relay(relay) {}
+
+  void SetPeers(PeerConnection *a, PeerConnection *b) {
+    pc[0] = a;
+    pc[1] = b;
+  }
+
+  // Only the first IPv4 UDP host candidate of each peer goes through the relay, the rest are dropped
+  void OnCandidate(int from, const PeerConnection::IceCandidate &candidate) {
+    std::istringstream fields(candidate.candidate);
+    std::string foundation, component, transport, priority, ip, port, typ, type;
+    fields >> foundation >> component >> transport >> priority >> ip >> port >> typ >> type;
+    if (transport != "UDP" || type != "host" || ip.find(':') != std::string::npos) {
+      return;
+    }
+    std::string rewritten;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (candidate_sent[from]) {
+        return;
+      }
+      candidate_sent[from] = true;
+      relay.SetPeer(from, ip, (uint16_t)atoi(port.c_str()));
+      // The other peer reaches us at the relay side that forwards to us, and sees our datagrams come from there
+      rewritten = foundation + " " + component + " " + transport + " " + priority + " 127.0.0.1 " + std::to_string(relay.Port(from)) + " typ host";
+      if (!descriptions_set) {
+        pending[1 - from].push_back(rewritten);
+        return;
+      }
+    }
+    pc[1 - from]->SetRemoteIceCandidate(rewritten);
+  }
+
+  void Connect() {
+    pc[1]->ParseOffer(WithoutCandidates(pc[0]->GenerateOffer()));
+    pc[0]->ParseOffer(WithoutCandidates(pc[1]->GenerateAnswer()));
+    std::vector<std::string> early[2];
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      descriptions_set = true;
+      early[0].swap(pending[0]);
+      early[1].swap(pending[1]);
+    }
+    for (int side = 0; side < 2; side++) {
+      for (const auto &candidate : early[side]) {
+        pc[side]->SetRemoteIceCandidate(candidate);
+      }
+    }
+  }
+
+ private:
+  DelayRelay &relay;
+  PeerConnection *pc[2]{nullptr, nullptr};
+  std::mutex mutex;
+  bool candidate_sent[2]{false, false};
+  bool descriptions_set{false};
+  std::vector<std::string> pending[2];
+
+  // Candidates gathered before the description was made would bypass the relay
+  static std::string WithoutCandidates(const std::string &sdp) {
+    std::istringstream lines(sdp);
+    std::string line, result;
+    while (std::getline(lines, line)) {
+      if (line.compare(0, 12, "a=candidate:") != 0) {
+        result += line + "\n";
+      }
+    }
+    return result;
+  }
+};
+
+// Transfer megabytes from one peer to the other, returns the throughput in Mbit/s or a negative value on failure
+static double RunTransfer(const char *name, const RTCSctpConfiguration &sctp, std::chrono::milliseconds delay, size_t megabytes) {
+  DelayRelay relay(delay);
+  Signalling signalling(relay);
+
+  RTCTransportConfiguration transport;
+  transport.sctp = sctp;
+
+  const size_t total = megabytes * 1024 * 1024;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t received = 0;
+  bool opened = false;
+  std::chrono::steady_clock::time_point done;
+
+  auto on_channel = [&](std::shared_ptr<DataChannel> channel) {
+    channel->SetOnBinaryMsgCallback([&](ChunkPtr chunk) {
+      std::lock_guard<std::mutex> lock(mutex);
+      received += chunk->Length();
+      if (received >= total) {
+        done = std::chrono::steady_clock::now();
+        cv.notify_all();
+      }
+    });
+  };
+
+  PeerConnection a(IceConfig(), [&](PeerConnection::IceCandidate candidate) { signalling.OnCandidate(0, candidate); },
+                   [](std::shared_ptr<DataChannel>) {}, transport);
+  PeerConnection b(IceConfig(), [&](PeerConnection::IceCandidate candidate) { signalling.OnCandidate(1, candidate); }, on_channel,
+                   transport);
+  signalling.SetPeers(&a, &b);
+  signalling.Connect();
+
+  auto channel = a.CreateDataChannel("benchmark");
+  channel->SetOnOpen([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    opened = true;
+    cv.notify_all();
+  });
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!cv.wait_for(lock, std::chrono::seconds(BENCH_TIMEOUT_S), [&] { return opened; })) {
+      fprintf(stderr, "%s: the data channel did not open\n", name);
+      return -1;
+    }
+  }
+
+  std::vector<uint8_t> message(BENCH_MESSAGE_SIZE, 0x5a);
+  auto start = std::chrono::steady_clock::now();
+  try {
+    for (size_t sent = 0; sent < total; sent += message.size()) {
+      channel->SendBinary(message.data(), (int)std::min(message.size(), total - sent));
+    }
+  } catch (const std::runtime_error &e) {
+    fprintf(stderr, "%s: %s\n", name, e.what());
+    return -1;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!cv.wait_for(lock, std::chrono::seconds(BENCH_TIMEOUT_S), [&] { return received >= total; })) {
+    fprintf(stderr, "%s: only %zu of %zu bytes arrived\n", name, received, total);
+    return -1;
+  }
+  double seconds = std::chrono::duration<double>(done - start).count();
+  return total * 8 / seconds / 1e6;
+}
+
+int main(int argc, char **argv) {
+  std::chrono::milliseconds delay(argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_DELAY_MS);
+  size_t megabytes = argc > 2 ? (size_t)atoi(argv[2]) : BENCH_DEFAULT_MEGABYTES;
+
+  struct Preset {
+    const char *name;
+    RTCSctpConfiguration config;
+  } presets[] = {{"default", RTCSctpConfiguration()}, {"HighThroughput", RTCSctpConfiguration::HighThroughput()}};
+
+  printf("%zu MB, %lld ms each way\n", megabytes, (long long)delay.count());
+  int result = 0;
+  for (const auto &preset : presets) {
+    double mbits = RunTransfer(preset.name, preset.config, delay, megabytes);
+    if (mbits < 0) {
+      result = 1;
+    } else {
+      printf("%-16s %8.1f Mbit/s\n", preset.name, mbits);
+    }
+  }
+  return result;
+}
@@ -0,0 +1,221 @@
+/**
+ * Copyright (c) 2017, Andrew Gault, Nick Chadwick and Guillaume Egles.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the <organization> nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * Loopback test for UdpMux: STUN binding requests are authenticated with MESSAGE-INTEGRITY,
+ * answered with XOR-MAPPED-ADDRESS, MESSAGE-INTEGRITY and FINGERPRINT, and latch the peer's
+ * address for data in both directions. Exits non-zero on the first failed check.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/hmac.h>
+
+#include "UdpMux.hpp"
+
+using namespace rtcdcpp;
+
+#define CHECK(cond)                                                                 \
+  do {                                                                              \
+    if (!(cond)) {                                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);     \
+      return 1;                                                                     \
+    }                                                                               \
+  } while (0)
+
+static void Write16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+static void Write32(uint8_t *p, uint32_t value) {
+  Write16(p, (uint16_t)(value >> 16));
+  Write16(p + 2, (uint16_t)value);
+}
+
+static uint16_t Read16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+
+static uint32_t Read32(const uint8_t *p) { return ((uint32_t)Read16(p) << 16) | Read16(p + 2); }
+
+// Bitwise CRC-32 (ISO 3309), kept independent of the table-driven one in UdpMux.cpp
+static uint32_t Crc32(const uint8_t *data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+// Binding request with USERNAME, USE-CANDIDATE, MESSAGE-INTEGRITY keyed with key and FINGERPRINT
+static size_t BindingRequest(uint8_t *msg, const std::string &username, const std::string &key) {
+  memset(msg, 0, 20);
+  Write16(msg, 0x0001);
+  Write32(msg + 4, 0x2112A442);
+  for (int i = 0; i < 12; i++) {
+    msg[8 + i] = (uint8_t)i;
+  }
+  size_t len = 20;
+
+  Write16(msg + len, 0x0006);
+  Write16(msg + len + 2, (uint16_t)username.size());
+  memset(msg + len + 4, 0, (username.size() + 3) & ~(size_t)3);
+  memcpy(msg + len + 4, username.data(), username.size());
+  len += 4 + ((username.size() + 3) & ~(size_t)3);
+
+  Write16(msg + len, 0x0025);
+  Write16(msg + len + 2, 0);
+  len += 4;
+
+  // The length field covers MESSAGE-INTEGRITY while it is computed, and FINGERPRINT afterwards
+  unsigned int mac_len;
+  Write16(msg + 2, (uint16_t)(len + 24 - 20));
+  Write16(msg + len, 0x0008);
+  Write16(msg + len + 2, 20);
+  HMAC(EVP_sha1(), key.data(), (int)key.size(), msg, len, msg + len + 4, &mac_len);
+  len += 24;
+
+  Write16(msg + 2, (uint16_t)(len + 8 - 20));
+  Write16(msg + len, 0x8028);
+  Write16(msg + len + 2, 4);
+  Write32(msg + len + 4, Crc32(msg, len) ^ 0x5354554e);
+  return len + 8;
+}
+
+// Checks the trailing MESSAGE-INTEGRITY and FINGERPRINT of a response
+static bool VerifyResponse(const uint8_t *msg, size_t len, const std::string &key) {
+  if (len < 20 + 24 + 8 || Read16(msg + 2) + 20u != len) {
+    return false;
+  }
+  size_t fingerprint = len - 8;
+  if (Read16(msg + fingerprint) != 0x8028 || Read32(msg + fingerprint + 4) != (Crc32(msg, fingerprint) ^ 0x5354554e)) {
+    return false;
+  }
+
+  size_t integrity = fingerprint - 24;
+  if (Read16(msg + integrity) != 0x0008) {
+    return false;
+  }
+  uint8_t covered[512];
+  memcpy(covered, msg, integrity);
+  Write16(covered + 2, (uint16_t)(integrity + 24 - 20));
+  uint8_t mac[20];
+  unsigned int mac_len;
+  HMAC(EVP_sha1(), key.data(), (int)key.size(), covered, integrity, mac, &mac_len);
+  return memcmp(mac, msg + integrity + 4, sizeof(mac)) == 0;
+}
+
+static uint16_t XorMappedPort(const uint8_t *msg, size_t len) {
+  size_t offset = 20;
+  while (offset + 4 <= len) {
+    uint16_t type = Read16(msg + offset);
+    uint16_t attr_len = Read16(msg + offset + 2);
+    if (type == 0x0020 && attr_len >= 8) {
+      return Read16(msg + offset + 6) ^ 0x2112;
+    }
+    offset += 4 + ((attr_len + 3) & ~3);
+  }
+  return 0;
+}
+
+static bool WaitFor(const std::atomic<int> &counter, int value) {
+  for (int i = 0; i < 100 && counter < value; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return counter >= value;
+}
+
+int main() {
+  UdpMux mux("127.0.0.1", 0, 2);
+  std::atomic<int> ready{0};
+  std::atomic<int> received{0};
+  auto peer = mux.Register([&]() { ready++; }, [&](ChunkPtr) { received++; });
+  CHECK(mux.Port() != 0);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  CHECK(fd >= 0);
+  struct timeval timeout = {0, 300 * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(mux.Port());
+  inet_pton(AF_INET, "127.0.0.1", &to.sin_addr);
+
+  uint8_t request[512];
+  uint8_t response[512];
+  std::string username = peer->LocalUfrag() + ":remote";
+
+  // Keyed with the wrong password: no answer, and the peer stays unbound
+  size_t len = BindingRequest(request, username, "not-the-password");
+  CHECK(sendto(fd, request, len, 0, (struct sockaddr *)&to, sizeof(to)) == (ssize_t)len);
+  CHECK(recv(fd, response, sizeof(response), 0) < 0);
+  CHECK(ready == 0);
+
+  len = BindingRequest(request, username, peer->LocalPwd());
+  CHECK(sendto(fd, request, len, 0, (struct sockaddr *)&to, sizeof(to)) == (ssize_t)len);
+  ssize_t response_len = recv(fd, response, sizeof(response), 0);
+  CHECK(response_len > 0);
+  CHECK(Read16(response) == 0x0101);
+  CHECK(memcmp(response + 8, request + 8, 12) == 0);
+  CHECK(VerifyResponse(response, (size_t)response_len, peer->LocalPwd()));
+
+  struct sockaddr_in local;
+  socklen_t local_len = sizeof(local);
+  getsockname(fd, (struct sockaddr *)&local, &local_len);
+  CHECK(XorMappedPort(response, (size_t)response_len) == ntohs(local.sin_port));
+  CHECK(WaitFor(ready, 1));
+
+  // Data from the latched address reaches the peer, a datagram too big for the buffers does not
+  uint8_t data[UDP_MUX_BUFFER_SIZE + 16] = {22, 1, 2, 3, 4};
+  CHECK(sendto(fd, data, sizeof(data), 0, (struct sockaddr *)&to, sizeof(to)) == (ssize_t)sizeof(data));
+  CHECK(sendto(fd, data, 5, 0, (struct sockaddr *)&to, sizeof(to)) == 5);
+  CHECK(WaitFor(received, 1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  CHECK(received == 1);
+
+  ChunkPtr chunks[1] = {std::make_shared<Chunk>(data, 5)};
+  CHECK(mux.Send(*peer, chunks, 1) == 1);
+  CHECK(recv(fd, response, sizeof(response), 0) == 5);
+
+  mux.Unregister(peer);
+  close(fd);
+  printf("UdpMuxTest passed\n");
+  return 0;
+}